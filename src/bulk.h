@@ -0,0 +1,216 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "error-handling.h"
+
+namespace eval {
+
+// A file of requests, one per line, mapped into memory and handed out to
+// worker threads in batches of consecutive lines. Lines are not copied until
+// a worker hands them to V8.
+class BulkInput {
+  public:
+    struct Line {
+      const char *data;
+      size_t length;
+    };
+
+    struct Batch {
+      uint64_t sequence;
+      uint64_t first_line; // 1-based
+      std::vector<Line> lines;
+    };
+
+  private:
+    const char *data = nullptr;
+    size_t size = 0;
+
+    std::mutex mutex;
+    size_t position = 0;
+    uint64_t next_sequence = 0;
+    uint64_t next_line = 1;
+
+  public:
+    BulkInput(const std::string &path)
+    {
+      int fd = open(path.c_str(), O_RDONLY);
+      if (fd < 0)
+        throw_with_trace(std::system_error(errno, std::generic_category(), "Cannot open " + path));
+      struct stat stat;
+      if (fstat(fd, &stat) != 0) {
+        close(fd);
+        throw_with_trace(std::system_error(errno, std::generic_category(), "Cannot stat " + path));
+      }
+      if (!S_ISREG(stat.st_mode)) {
+        close(fd);
+        throw_with_trace(std::runtime_error(path + " is not a regular file"));
+      }
+      size = stat.st_size;
+      if (size != 0) {
+        void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+          close(fd);
+          throw_with_trace(std::system_error(errno, std::generic_category(), "Cannot map " + path));
+        }
+        madvise(mapped, size, MADV_SEQUENTIAL);
+        data = static_cast<const char *>(mapped);
+      }
+      close(fd);
+    }
+
+    ~BulkInput()
+    {
+      if (data)
+        munmap(const_cast<char *>(data), size);
+    }
+
+    BulkInput(const BulkInput &) = delete;
+    BulkInput &operator=(const BulkInput &) = delete;
+
+    // The next up to max_lines lines (without their line breaks), or false
+    // at the end of the file. A final line break does not start another
+    // line.
+    bool next(Batch &batch, size_t max_lines)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (position >= size)
+        return false;
+      batch.sequence = next_sequence++;
+      batch.first_line = next_line;
+      batch.lines.clear();
+      while (position < size && batch.lines.size() < max_lines) {
+        const char *start = data + position;
+        const char *end = static_cast<const char *>(memchr(start, '\n', size - position));
+        size_t length = end ? end - start : size - position;
+        position += length + 1;
+        if (length != 0 && start[length - 1] == '\r')
+          length--;
+        batch.lines.push_back(Line{start, length});
+      }
+      next_line += batch.lines.size();
+      return true;
+    }
+
+    // Hands out no more batches.
+    void stop()
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      position = size;
+    }
+};
+
+// Where the responses to the batches of a BulkInput go: written to a file
+// (or stdout for "-") in the order of the batches, by whichever thread
+// completes the next one. Threads that get too far ahead of the writing
+// wait, so that memory use is bounded. Unordered, batches are written as
+// they are completed instead. Once aborted (after an error), nothing more
+// is written, and nobody waits.
+class BulkOutput {
+  private:
+    static constexpr uint64_t kMaxBatchesAhead = 1024;
+
+    struct Batch {
+      size_t lines;
+      std::string data;
+    };
+
+    FILE *file;
+    const bool ordered;
+    std::mutex mutex;
+    std::condition_variable cv;
+    uint64_t next_sequence = 0; // to be written
+    std::map<uint64_t, Batch> completed; // waiting for earlier ones
+    uint64_t lines_written = 0;
+    bool aborted = false;
+
+    void write_data(size_t lines, const std::string &data)
+    {
+      if (fwrite(data.data(), 1, data.size(), file) != data.size())
+        throw_with_trace(std::system_error(errno, std::generic_category(), "Cannot write output"));
+      lines_written += lines;
+    }
+
+  public:
+    BulkOutput(const std::string &path, bool ordered) :
+        ordered(ordered)
+    {
+      file = path == "-" ? stdout : fopen(path.c_str(), "w");
+      if (!file)
+        throw_with_trace(std::system_error(errno, std::generic_category(), "Cannot open " + path));
+    }
+
+    ~BulkOutput()
+    {
+      if (file != stdout)
+        fclose(file);
+    }
+
+    BulkOutput(const BulkOutput &) = delete;
+    BulkOutput &operator=(const BulkOutput &) = delete;
+
+    // Waits until the batch with the given sequence number may be worked on.
+    void wait_turn(uint64_t sequence)
+    {
+      if (!ordered)
+        return;
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&]{ return aborted || sequence < next_sequence + kMaxBatchesAhead; });
+    }
+
+    // The responses to a batch of the given number of lines, each on a line
+    // of its own.
+    void write(uint64_t sequence, size_t lines, std::string &&data)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (aborted)
+        return;
+      if (!ordered)
+        return write_data(lines, data);
+      if (sequence != next_sequence) {
+        completed.emplace(sequence, Batch{lines, std::move(data)});
+        return;
+      }
+      write_data(lines, data);
+      next_sequence++;
+      for (auto it = completed.begin(); it != completed.end() && it->first == next_sequence; it = completed.erase(it)) {
+        write_data(it->second.lines, it->second.data);
+        next_sequence++;
+      }
+      cv.notify_all();
+    }
+
+    void abort()
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      aborted = true;
+      cv.notify_all();
+    }
+
+    // Responses handed to the file so far (some maybe still buffered).
+    uint64_t written()
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      return lines_written;
+    }
+
+    void flush()
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (fflush(file) != 0)
+        throw_with_trace(std::system_error(errno, std::generic_category(), "Cannot write output"));
+    }
+};
+
+}
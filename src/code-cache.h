@@ -0,0 +1,300 @@
+#pragma once
+
+#include <atomic>
+#include <cstring>
+#include <fcntl.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <system_error>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include "error-handling.h"
+
+namespace eval {
+
+// Code cache data persisted in a file, so that a restarted process does not
+// have to compile everything again. The file is specific to a V8 version and
+// set of flags (the "version tag"), files for others are ignored. Records are
+// appended (by any number of processes sharing the directory), and the file
+// is memory-mapped when opened: only record headers and sources are read up
+// front, the data itself is paged in when a script is first requested.
+//
+// Format: a header (magic, version tag), then records of
+// { uint32 code length, uint32 data length, code, data }.
+class DiskCodeCache {
+  private:
+    static constexpr char kMagic[8] = {'e', 'v', 'a', 'l', 'c', 'c', '0', '1'};
+    static constexpr size_t kHeaderSize = sizeof(kMagic) + sizeof(uint32_t);
+    static constexpr size_t kRecordHeaderSize = 2 * sizeof(uint32_t);
+
+    // Stop appending beyond this, the file is not compacted.
+    static constexpr size_t kMaxFileSize = 256 * 1024 * 1024;
+
+    int fd = -1;
+    const char *mapping = nullptr;
+    size_t mapping_size = 0;
+    size_t file_size = 0;
+    std::unordered_map<std::string_view, std::string_view> index; // code -> data, in the mapping
+    std::unordered_set<size_t> appended; // hashes of code appended by this process
+
+  public:
+    DiskCodeCache(const std::string &directory, uint32_t version_tag)
+    {
+      char name[32];
+      snprintf(name, sizeof(name), "/code-cache-%08x.bin", version_tag);
+      std::string path = directory + name;
+      fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+      if (fd < 0)
+        throw_with_trace(std::system_error(errno, std::generic_category(), "Cannot open " + path));
+
+      // Hold the lock while checking the file, so that nobody appends to it.
+      if (flock(fd, LOCK_EX) != 0)
+        throw_with_trace(std::system_error(errno, std::generic_category(), "Cannot lock " + path));
+      struct stat stat;
+      if (fstat(fd, &stat) != 0)
+        throw_with_trace(std::system_error(errno, std::generic_category(), "Cannot stat " + path));
+      file_size = stat.st_size;
+
+      if (file_size > 0) {
+        mapping = static_cast<const char *>(mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0));
+        if (mapping == MAP_FAILED)
+          throw_with_trace(std::system_error(errno, std::generic_category(), "Cannot map " + path));
+        mapping_size = file_size;
+      }
+
+      size_t valid_size = 0;
+      if (file_size >= kHeaderSize && memcmp(mapping, kMagic, sizeof(kMagic)) == 0 &&
+          memcmp(mapping + sizeof(kMagic), &version_tag, sizeof(version_tag)) == 0) {
+        valid_size = kHeaderSize;
+        while (valid_size + kRecordHeaderSize <= file_size) {
+          uint32_t code_length, data_length;
+          memcpy(&code_length, mapping + valid_size, sizeof(code_length));
+          memcpy(&data_length, mapping + valid_size + sizeof(code_length), sizeof(data_length));
+          size_t record_size = kRecordHeaderSize + code_length + data_length;
+          if (record_size > file_size - valid_size)
+            break; // cut short by a crash while appending
+          const char *code = mapping + valid_size + kRecordHeaderSize;
+          index[std::string_view(code, code_length)] = std::string_view(code + code_length, data_length);
+          valid_size += record_size;
+        }
+      }
+
+      // Start over if the file is new or not ours, drop an incomplete last record.
+      if (valid_size == 0) {
+        if (ftruncate(fd, 0) != 0 || write(fd, kMagic, sizeof(kMagic)) != sizeof(kMagic) ||
+            write(fd, &version_tag, sizeof(version_tag)) != sizeof(version_tag))
+          throw_with_trace(std::system_error(errno, std::generic_category(), "Cannot initialize " + path));
+        valid_size = kHeaderSize;
+      } else if (valid_size != file_size && ftruncate(fd, valid_size) != 0) {
+        throw_with_trace(std::system_error(errno, std::generic_category(), "Cannot truncate " + path));
+      }
+      file_size = valid_size;
+      flock(fd, LOCK_UN);
+    }
+
+    ~DiskCodeCache()
+    {
+      if (mapping)
+        munmap(const_cast<char *>(mapping), mapping_size);
+      close(fd);
+    }
+
+    size_t entries() const { return index.size(); }
+
+    // Finds the data for the code, pointing into the mapping. Must be
+    // synchronized by the caller, as must all other methods.
+    bool find(const std::string &code, std::string_view &data)
+    {
+      auto found = index.find(std::string_view(code));
+      if (found == index.end())
+        return false;
+      data = found->second;
+      return true;
+    }
+
+    // The data on disk was not accepted by V8, do not offer it again.
+    void forget(const std::string &code)
+    {
+      index.erase(std::string_view(code));
+    }
+
+    void append(const std::string &code, const std::string &data)
+    {
+      std::string_view existing;
+      if (find(code, existing) || !appended.insert(std::hash<std::string>()(code)).second)
+        return;
+
+      size_t record_size = kRecordHeaderSize + code.size() + data.size();
+      if (file_size + record_size > kMaxFileSize)
+        return;
+
+      uint32_t lengths[2] = {static_cast<uint32_t>(code.size()), static_cast<uint32_t>(data.size())};
+      struct iovec parts[3] = {
+        {lengths, sizeof(lengths)},
+        {const_cast<char *>(code.data()), code.size()},
+        {const_cast<char *>(data.data()), data.size()},
+      };
+      // Appending is best-effort, a failure only costs a compilation later.
+      flock(fd, LOCK_EX);
+      ssize_t written = writev(fd, parts, 3);
+      flock(fd, LOCK_UN);
+      if (written > 0)
+        file_size += written;
+    }
+};
+
+// Process-wide cache of V8 code cache data (the serialized result of
+// compiling a script), keyed by the script's source. Shared by all threads,
+// so a script compiled on one isolate is cheap to compile on all others.
+// Bounded in size, least recently used entries are evicted first.
+class CodeCache {
+  public:
+    struct Stats {
+      uint64_t hits;
+      uint64_t disk_hits; // included in hits
+      uint64_t misses;
+      uint64_t rejections; // found, but V8 refused to use it
+      uint64_t evictions;
+      size_t entries;
+      size_t size;
+    };
+
+  private:
+    // Rough per-entry bookkeeping cost, counted against the size limit.
+    static constexpr size_t kEntryOverhead = 128;
+
+    // How many missed scripts to remember. Only scripts that miss twice are
+    // worth producing code cache data for, one-off scripts are not.
+    static constexpr size_t kMaxRememberedMisses = 4096;
+
+    struct Entry {
+      const std::string *code; // the key in the index
+      std::shared_ptr<const std::string> data;
+      size_t size() const { return code->size() + data->size() + kEntryOverhead; }
+    };
+
+    const size_t max_size;
+    std::mutex mutex;
+    std::list<Entry> entries; // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    size_t size = 0;
+    std::unordered_set<size_t> missed; // hashes of the code
+    std::unique_ptr<DiskCodeCache> disk;
+
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> disk_hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> rejections{0};
+    std::atomic<uint64_t> evictions{0};
+
+    // Must hold the mutex.
+    void erase(std::list<Entry>::iterator entry)
+    {
+      size -= entry->size();
+      const std::string *code = entry->code;
+      entries.erase(entry);
+      index.erase(index.find(*code));
+    }
+
+    // Must hold the mutex.
+    void insert_locked(const std::string &code, std::shared_ptr<const std::string> data)
+    {
+      size_t entry_size = code.size() + data->size() + kEntryOverhead;
+      if (entry_size > max_size)
+        return;
+
+      auto found = index.find(code);
+      if (found != index.end())
+        erase(found->second);
+      while (size + entry_size > max_size) {
+        erase(std::prev(entries.end()));
+        evictions++;
+      }
+      missed.erase(std::hash<std::string>()(code));
+      auto inserted = index.emplace(code, entries.end()).first;
+      entries.push_front(Entry{&inserted->first, std::move(data)});
+      inserted->second = entries.begin();
+      size += entry_size;
+    }
+
+  public:
+    CodeCache(size_t max_size) : max_size(max_size) {}
+
+    bool enabled() const { return max_size > 0; }
+
+    // Also keep the data of scripts worth caching in the given directory,
+    // and use what previous processes have left there. Call after V8 is
+    // initialized, with its CachedDataVersionTag().
+    void open_directory(const std::string &directory, uint32_t version_tag)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      disk = std::make_unique<DiskCodeCache>(directory, version_tag);
+    }
+
+    // Returns the data for the code, or nullptr. The data stays valid for as
+    // long as the caller holds on to it, even if evicted in the meantime. On
+    // a miss, worth_inserting tells whether the code was seen recently.
+    std::shared_ptr<const std::string> lookup(const std::string &code, bool &worth_inserting)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto found = index.find(code);
+      std::string_view disk_data;
+      if (found == index.end() && disk && disk->find(code, disk_data)) {
+        hits++;
+        disk_hits++;
+        worth_inserting = false;
+        auto data = std::make_shared<const std::string>(disk_data);
+        insert_locked(code, data);
+        return data;
+      }
+      if (found == index.end()) {
+        misses++;
+        if (missed.size() >= kMaxRememberedMisses)
+          missed.clear();
+        worth_inserting = !missed.insert(std::hash<std::string>()(code)).second;
+        return nullptr;
+      }
+      worth_inserting = false;
+      hits++;
+      entries.splice(entries.begin(), entries, found->second);
+      return found->second->data;
+    }
+
+    void insert(const std::string &code, std::string &&data)
+    {
+      auto shared_data = std::make_shared<const std::string>(std::move(data));
+      std::lock_guard<std::mutex> lock(mutex);
+      insert_locked(code, shared_data);
+      if (disk)
+        disk->append(code, *shared_data);
+    }
+
+    // V8 did not accept the data (e.g. it was produced with other flags), so
+    // drop it, and have it recreated by the next compilation.
+    void reject(const std::string &code)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      rejections++;
+      auto found = index.find(code);
+      if (found != index.end())
+        erase(found->second);
+      if (disk)
+        disk->forget(code);
+    }
+
+    Stats stats()
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      return Stats{hits, disk_hits, misses, rejections, evictions, entries.size(), size};
+    }
+};
+
+}
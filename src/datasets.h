@@ -0,0 +1,120 @@
+#pragma once
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <v8.h>
+#include "error-handling.h"
+
+namespace eval {
+
+// A named, read-only JSON document loaded at startup, which all requests see
+// as a variable.
+struct Dataset {
+  std::string name;
+  std::string path;
+};
+
+// Freezes everything reachable from the datasets and from the global object
+// of the context they were parsed in, including intrinsics only reachable
+// through instances. Requests share that context, so none of its state may
+// be writable, or one request could leave something behind for the next.
+constexpr char kHardenDatasetsSource[] = R"(
+(function (datasets) {
+  'use strict';
+  const { freeze, getPrototypeOf, getOwnPropertyDescriptor } = Object;
+  const { ownKeys } = Reflect;
+
+  // Legacy RegExp statics hold the last match of the context.
+  for (const name of ['input', '$_', 'lastMatch', '$&', 'lastParen', '$+', 'leftContext', '$`',
+                      'rightContext', "$'", '$1', '$2', '$3', '$4', '$5', '$6', '$7', '$8', '$9'])
+    delete RegExp[name];
+
+  const stack = [
+    globalThis,
+    datasets,
+    function*() {},
+    async function() {},
+    async function*() {},
+    (function*() {})(),
+    (async function*() {})(),
+    [][Symbol.iterator](),
+    new Map()[Symbol.iterator](),
+    new Set()[Symbol.iterator](),
+    ''[Symbol.iterator](),
+    /x/[Symbol.matchAll](''),
+  ];
+  const seen = new Set();
+  while (stack.length > 0) {
+    const value = stack.pop();
+    if (value === null || (typeof value !== 'object' && typeof value !== 'function') || seen.has(value))
+      continue;
+    seen.add(value);
+    freeze(value);
+    stack.push(getPrototypeOf(value));
+    for (const key of ownKeys(value)) {
+      const descriptor = getOwnPropertyDescriptor(value, key);
+      if ('value' in descriptor)
+        stack.push(descriptor.value);
+      else
+        stack.push(descriptor.get, descriptor.set);
+    }
+  }
+})
+)";
+
+inline std::string read_dataset_file(const Dataset &dataset)
+{
+  std::ifstream file(dataset.path, std::ios::binary);
+  std::stringstream contents;
+  contents << file.rdbuf();
+  if (!file)
+    throw_with_trace(std::runtime_error("Cannot read dataset '" + dataset.name + "' from " + dataset.path));
+  return contents.str();
+}
+
+// Parses the datasets in the given context (which should be used for nothing
+// else), and returns an object with a property for each, to be used as a
+// context extension. The object has no prototype, so that only the datasets
+// are in scope. Can be done when creating the startup snapshot.
+inline v8::Local<v8::Object> load_datasets(v8::Local<v8::Context> context, const std::vector<Dataset> &datasets)
+{
+  v8::Isolate *isolate = context->GetIsolate();
+  v8::EscapableHandleScope handle_scope(isolate);
+  v8::Context::Scope context_scope(context);
+
+  std::vector<v8::Local<v8::Name>> names;
+  std::vector<v8::Local<v8::Value>> values;
+  for (const Dataset &dataset : datasets) {
+    std::string json = read_dataset_file(dataset);
+    v8::Local<v8::String> json_string;
+    v8::Local<v8::Value> value;
+    if (!v8::String::NewFromUtf8(isolate, json.data(), v8::NewStringType::kNormal, json.length()).ToLocal(&json_string) ||
+        !v8::JSON::Parse(context, json_string).ToLocal(&value))
+      throw_with_trace(std::runtime_error("Dataset '" + dataset.name + "' is not valid JSON"));
+    names.push_back(v8::String::NewFromUtf8(isolate, dataset.name.data(), v8::NewStringType::kInternalized, dataset.name.length()).ToLocalChecked());
+    values.push_back(value);
+  }
+  return handle_scope.Escape(v8::Object::New(isolate, v8::Null(isolate), names.data(), values.data(), names.size()));
+}
+
+// Freezes the datasets and everything reachable in their context. Must not be
+// done before creating the startup snapshot, since deserializing a context
+// modifies its global object.
+inline void harden_datasets(v8::Local<v8::Object> extension)
+{
+  v8::Isolate *isolate = extension->GetIsolate();
+  v8::HandleScope handle_scope(isolate);
+  v8::Local<v8::Context> context = extension->CreationContext();
+  v8::Context::Scope context_scope(context);
+
+  v8::Local<v8::String> harden_source = v8::String::NewFromUtf8(isolate, kHardenDatasetsSource, v8::NewStringType::kNormal).ToLocalChecked();
+  v8::Local<v8::Value> harden = v8::Script::Compile(context, harden_source).ToLocalChecked()->Run(context).ToLocalChecked();
+  v8::Local<v8::Value> arguments[] = {extension};
+  if (v8::Local<v8::Function>::Cast(harden)->Call(context, context->Global(), 1, arguments).IsEmpty())
+    throw_with_trace(std::runtime_error("Cannot freeze datasets"));
+}
+
+}
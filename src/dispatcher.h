@@ -0,0 +1,329 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include "msgpack.h"
+
+namespace eval {
+
+// Requests are scheduled in classes: short, latency-sensitive ones must not
+// wait behind long-running ones.
+enum class LatencyClass { interactive, batch };
+constexpr size_t kLatencyClassCount = 2;
+
+inline const char *latency_class_name(LatencyClass latency_class)
+{
+  return latency_class == LatencyClass::interactive ? "interactive" : "batch";
+}
+
+// What decides a request's class: an explicit "priority", or else the
+// request's "timeout" (and whether it is a batch request). And how long
+// requests may wait to be started.
+struct SchedulingOptions {
+  uint32_t short_timeout_millis = 50; // requests with a timeout up to this are interactive
+  size_t reserved_threads = 0; // never run batch requests
+  uint32_t max_queue_wait_millis = 0; // 0 for no limit
+};
+
+// The top-level request fields that scheduling looks at, read from the
+// request without parsing it: everything else is skipped over. Malformed
+// requests are scheduled like any other, the worker reports them. Whether
+// the request is pure is read along the way, so that workers only build a
+// result cache key for requests that can be memoized.
+struct SchedulingHints {
+  enum class Priority { unset, interactive, batch };
+
+  uint32_t timeout_millis = 10; // the default timeout
+  uint32_t deadline_millis = 0; // 0 if not set
+  bool has_contexts = false;
+  Priority priority = Priority::unset;
+  bool pure = false; // "pure": true
+
+  static Priority parse_priority(const char *data, size_t length)
+  {
+    if (length == 11 && memcmp(data, "interactive", 11) == 0)
+      return Priority::interactive;
+    if (length == 5 && memcmp(data, "batch", 5) == 0)
+      return Priority::batch;
+    return Priority::unset;
+  }
+
+  static bool is_json_whitespace(char c) { return c == ' ' || c == '\n' || c == '\r' || c == '\t'; }
+
+  // Skips a JSON value, not checking much beyond matching brackets and
+  // quotes. Returns the position after it.
+  static const char *skip_json_value(const char *position, const char *end)
+  {
+    int depth = 0;
+    while (position < end) {
+      char c = *position++;
+      if (c == '"') {
+        while (position < end && *position != '"')
+          position += *position == '\\' ? 2 : 1;
+        position++;
+      } else if (c == '{' || c == '[') {
+        depth++;
+        continue;
+      } else if (c == '}' || c == ']') {
+        depth--;
+      } else if (depth == 0) {
+        while (position < end && !is_json_whitespace(*position) && *position != ',' && *position != '}' && *position != ']')
+          position++;
+      }
+      if (depth <= 0)
+        break;
+    }
+    return std::min(position, end);
+  }
+
+  static SchedulingHints from_json(const std::string &blob)
+  {
+    SchedulingHints hints;
+    const char *position = blob.data(), *end = blob.data() + blob.size();
+    auto skip_whitespace = [&]{ while (position < end && is_json_whitespace(*position)) position++; };
+
+    skip_whitespace();
+    if (position == end || *position++ != '{')
+      return hints;
+    while (true) {
+      skip_whitespace();
+      if (position == end || *position != '"')
+        return hints;
+      const char *key = ++position;
+      while (position < end && *position != '"' && *position != '\\')
+        position++;
+      size_t key_length = position - key;
+      position = skip_json_value(key - 1, end);
+      skip_whitespace();
+      if (position == end || *position++ != ':')
+        return hints;
+      skip_whitespace();
+
+      const char *value = position;
+      position = skip_json_value(position, end);
+      if (key_length == 7 && memcmp(key, "timeout", 7) == 0) {
+        hints.timeout_millis = strtoul(std::string(value, position - value).c_str(), nullptr, 10);
+      } else if (key_length == 8 && memcmp(key, "deadline", 8) == 0) {
+        hints.deadline_millis = strtoul(std::string(value, position - value).c_str(), nullptr, 10);
+      } else if (key_length == 8 && memcmp(key, "contexts", 8) == 0) {
+        hints.has_contexts = true;
+      } else if (key_length == 8 && memcmp(key, "priority", 8) == 0 && position - value >= 2 && *value == '"') {
+        hints.priority = parse_priority(value + 1, position - value - 2);
+      } else if (key_length == 4 && memcmp(key, "pure", 4) == 0) {
+        hints.pure = position - value == 4 && memcmp(value, "true", 4) == 0;
+      }
+
+      skip_whitespace();
+      if (position == end || *position++ != ',')
+        return hints;
+    }
+  }
+
+  // Reads an encoded MessagePack unsigned integer of up to 32 bits, leaves
+  // the number alone if it is anything else.
+  static void msgpack_uint32(const char *value, size_t length, uint32_t &number)
+  {
+    uint8_t tag = *value;
+    if (tag <= 0x7f) {
+      number = tag;
+    } else if (tag >= 0xcc && tag <= 0xce) {
+      number = 0;
+      for (size_t byte = 1; byte < length; byte++)
+        number = (number << 8) | static_cast<uint8_t>(value[byte]);
+    }
+  }
+
+  static SchedulingHints from_msgpack(const std::string &blob)
+  {
+    SchedulingHints hints;
+    msgpack::Scanner scanner(blob);
+    uint64_t count;
+    if (!scanner.map_header(count))
+      return hints;
+    for (uint64_t i = 0; i < count; i++) {
+      const char *key, *value;
+      size_t key_length, value_length;
+      if (!scanner.string(key, key_length) || !scanner.value(value, value_length))
+        return hints;
+      uint8_t tag = *value;
+      if (key_length == 7 && memcmp(key, "timeout", 7) == 0) {
+        msgpack_uint32(value, value_length, hints.timeout_millis);
+      } else if (key_length == 8 && memcmp(key, "deadline", 8) == 0) {
+        msgpack_uint32(value, value_length, hints.deadline_millis);
+      } else if (key_length == 8 && memcmp(key, "contexts", 8) == 0) {
+        hints.has_contexts = true;
+      } else if (key_length == 8 && memcmp(key, "priority", 8) == 0 && (tag & 0xe0) == 0xa0) {
+        hints.priority = parse_priority(value + 1, value_length - 1);
+      } else if (key_length == 4 && memcmp(key, "pure", 4) == 0) {
+        hints.pure = tag == 0xc3;
+      }
+    }
+    return hints;
+  }
+
+  static SchedulingHints from_request(const std::string &blob)
+  {
+    return msgpack::is_msgpack(blob) ? from_msgpack(blob) : from_json(blob);
+  }
+
+  LatencyClass latency_class(const SchedulingOptions &options) const
+  {
+    if (priority != Priority::unset)
+      return priority == Priority::interactive ? LatencyClass::interactive : LatencyClass::batch;
+    return has_contexts || timeout_millis > options.short_timeout_millis ? LatencyClass::batch : LatencyClass::interactive;
+  }
+};
+
+// Hands complete requests from the I/O thread to the worker threads. There
+// is one queue per class for all workers, so a request never waits behind a
+// busy worker while another one is idle: whichever worker is free first
+// takes the oldest request, interactive ones first. Batch requests are only
+// started while more than the reserved number of workers would remain for
+// interactive ones.
+//
+// Requests have a deadline to be started by, from the request's "deadline"
+// and the server's maximum queue wait. Requests past it are still handed
+// out (even batch ones beyond the limit), but as overdue, to be rejected
+// without evaluating them.
+template <class Job>
+class Dispatcher {
+  public:
+    struct ClassStats {
+      size_t queued; // right now
+      uint64_t dispatched;
+      uint64_t overdue; // not included in dispatched
+      uint64_t total_wait; // in ns, of dispatched requests
+      uint64_t max_wait; // in ns
+    };
+
+    // How a job was handed out, to be given back to done().
+    struct Dispatch {
+      LatencyClass latency_class;
+      bool overdue;
+      bool counts_as_batch; // against the limit
+      uint64_t wait; // in ns, since pushed
+    };
+
+  private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Queued {
+      Job job;
+      Clock::time_point since;
+      Clock::time_point deadline;
+    };
+
+    const SchedulingOptions scheduling;
+    const size_t max_batch_running;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::array<std::deque<Queued>, kLatencyClassCount> queues;
+    std::array<ClassStats, kLatencyClassCount> class_stats = {};
+    size_t batch_running = 0;
+
+    std::deque<Queued> &queue(LatencyClass latency_class) { return queues[static_cast<size_t>(latency_class)]; }
+
+  public:
+    Dispatcher(size_t threads, const SchedulingOptions &scheduling) :
+        scheduling(scheduling),
+        max_batch_running(threads > scheduling.reserved_threads ? threads - scheduling.reserved_threads : 1)
+    {
+    }
+
+    void push(Job &&job, const SchedulingHints &hints)
+    {
+      Clock::time_point now = Clock::now();
+      uint32_t max_wait_millis = scheduling.max_queue_wait_millis;
+      if (hints.deadline_millis != 0 && (max_wait_millis == 0 || hints.deadline_millis < max_wait_millis))
+        max_wait_millis = hints.deadline_millis;
+      Clock::time_point deadline = max_wait_millis == 0 ? Clock::time_point::max() : now + std::chrono::milliseconds(max_wait_millis);
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue(hints.latency_class(scheduling)).push_back(Queued{std::move(job), now, deadline});
+      }
+      cv.notify_one();
+    }
+
+    // Blocks until there is a job this worker may run (or must reject).
+    // Call done() once finished with it.
+    Job pop(Dispatch &dispatch)
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      std::deque<Queued> &interactive = queue(LatencyClass::interactive);
+      std::deque<Queued> &batch = queue(LatencyClass::batch);
+      while (true) {
+        Clock::time_point now = Clock::now();
+        if (!interactive.empty()) {
+          dispatch = Dispatch{LatencyClass::interactive, interactive.front().deadline <= now, false, 0};
+          break;
+        }
+        if (!batch.empty() && batch_running < max_batch_running) {
+          dispatch = Dispatch{LatencyClass::batch, batch.front().deadline <= now, true, 0};
+          batch_running++;
+          break;
+        }
+        if (!batch.empty() && batch.front().deadline <= now) {
+          dispatch = Dispatch{LatencyClass::batch, true, false, 0};
+          break;
+        }
+        if (!batch.empty() && batch.front().deadline != Clock::time_point::max())
+          cv.wait_until(lock, batch.front().deadline);
+        else
+          cv.wait(lock);
+      }
+
+      std::deque<Queued> &jobs = queue(dispatch.latency_class);
+      ClassStats &stats = class_stats[static_cast<size_t>(dispatch.latency_class)];
+      dispatch.wait = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - jobs.front().since).count();
+      if (dispatch.overdue) {
+        stats.overdue++;
+      } else {
+        stats.dispatched++;
+        stats.total_wait += dispatch.wait;
+        stats.max_wait = std::max(stats.max_wait, dispatch.wait);
+      }
+
+      Job job = std::move(jobs.front().job);
+      jobs.pop_front();
+      return job;
+    }
+
+    // Whether pop() would return a job right away, for workers to decide if
+    // there is time for something else first.
+    bool work_available()
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      const std::deque<Queued> &batch = queue(LatencyClass::batch);
+      return !queue(LatencyClass::interactive).empty() ||
+             (!batch.empty() && (batch_running < max_batch_running || batch.front().deadline <= Clock::now()));
+    }
+
+    void done(const Dispatch &dispatch)
+    {
+      if (!dispatch.counts_as_batch)
+        return;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        batch_running--;
+      }
+      cv.notify_one();
+    }
+
+    std::array<ClassStats, kLatencyClassCount> stats()
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      std::array<ClassStats, kLatencyClassCount> result = class_stats;
+      for (size_t i = 0; i < kLatencyClassCount; i++)
+        result[i].queued = queues[i].size();
+      return result;
+    }
+};
+
+}
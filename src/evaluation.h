@@ -4,18 +4,118 @@
 #include <libplatform/libplatform.h>
 #include <v8.h>
 #include "time.h"
+#include <algorithm>
 #include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
+#include "code-cache.h"
+#include "datasets.h"
 #include "error-handling.h"
+#include "json-writer.h"
+#include "lazy-json.h"
+#include "metrics.h"
+#include "msgpack.h"
+#include "profiler.h"
+#include "result-cache.h"
+#include "script-registry.h"
+#include "trace.h"
+#include "watchdog.h"
 
 namespace eval {
 
+// Server-wide settings, from the command line.
+struct Options {
+  size_t code_cache_size = 32 * 1024 * 1024;
+  std::string code_cache_directory; // empty to not persist
+  size_t registered_scripts_size = 64 * 1024 * 1024;
+  std::vector<Dataset> datasets;
+  size_t result_cache_size = 16 * 1024 * 1024;
+  std::chrono::milliseconds result_cache_ttl = std::chrono::seconds(60);
+  uint64_t recycle_requests = 0; // 0 for never
+  size_t recycle_heap_size = 0; // 0 for never
+  std::string trace_file; // empty to not trace
+  uint64_t trace_sample = 100; // trace every Nth request of each thread
+  uint64_t profile_sample = 0; // profile every Nth request of each thread, 0 for none
+};
+
+class VeryBadArrayBufferAllocator : public v8::ArrayBuffer::Allocator {
+    void* Allocate(size_t length) override { return NULL; }
+    void* AllocateUninitialized(size_t length) override { return NULL; }
+    void Free(void* data, size_t) override { }
+};
+
+// The isolate gets deleted by its {Dispose} method, not by the default
+// deleter. Therefore we have to define a custom deleter for the unique_ptr to
+// call {Dispose}. We have to use the unique_ptr so that the isolate get
+// disposed in the right order, relative to other member variables.
+struct IsolateDeleter {
+  void operator()(v8::Isolate* isolate) const { isolate->Dispose(); }
+};
+typedef std::unique_ptr<v8::Isolate, IsolateDeleter> OwnedIsolate;
+
 class GlobalContext {
+  friend class ThreadContext;
+  friend class RequestContext;
   private:
     std::unique_ptr<v8::Platform> platform;
+    CodeCache code_cache;
+    ScriptRegistry scripts;
+    ResultCache result_cache;
+    CpuWatchdog cpu_watchdog;
+    VeryBadArrayBufferAllocator allocator;
+    Metrics metrics;
+    TraceLog trace_log;
+    ScriptProfiles script_profiles;
+
+    // Startup snapshot all isolates are created from. Besides V8's builtins,
+    // it contains a user context that is ready to be used for a request, and
+    // the datasets.
+    v8::StartupData snapshot;
+    size_t datasets_heap_size = 0;
+    void create_snapshot(const Options &options); // defined after RequestContext
+    OwnedIsolate create_isolate(); // defined after RequestContext
+
+    // When threads replace their isolate with a new one.
+    const uint64_t recycle_requests;
+    const size_t recycle_heap_size;
+
+    // A new isolate, created on a thread of its own ahead of time, for the
+    // next thread that replaces its isolate. Another one is made once it is
+    // taken.
+    std::mutex spare_mutex;
+    std::condition_variable spare_cv;
+    OwnedIsolate spare_isolate;
+    bool spare_wanted = false;
+    bool spare_exiting = false;
+    std::thread spare_thread;
+
+    void spare_thread_main()
+    {
+      std::unique_lock<std::mutex> lock(spare_mutex);
+      while (true) {
+        spare_cv.wait(lock, [this]{ return spare_exiting || spare_wanted; });
+        if (spare_exiting)
+          return;
+        lock.unlock();
+        OwnedIsolate isolate = create_isolate();
+        lock.lock();
+        spare_isolate = std::move(isolate);
+        spare_wanted = false;
+      }
+    }
 
   public:
-    GlobalContext()
+    GlobalContext(const Options &options) :
+        code_cache(options.code_cache_size),
+        scripts(options.registered_scripts_size),
+        result_cache(options.result_cache_size, options.result_cache_ttl),
+        trace_log(options.trace_file, options.trace_sample),
+        script_profiles(options.profile_sample),
+        recycle_requests(options.recycle_requests),
+        recycle_heap_size(options.recycle_heap_size)
     {
       constexpr char kFlags[] =
         "--no-expose-wasm ";
@@ -24,158 +124,219 @@ class GlobalContext {
       platform = v8::platform::NewDefaultPlatform();
       v8::V8::InitializePlatform(platform.get());
       v8::V8::Initialize();
+
+      create_snapshot(options);
+
+      if (code_cache.enabled() && !options.code_cache_directory.empty())
+        code_cache.open_directory(options.code_cache_directory, v8::ScriptCompiler::CachedDataVersionTag());
+
+      spare_thread = std::thread(&GlobalContext::spare_thread_main, this);
     }
 
     ~GlobalContext()
     {
+      {
+        std::lock_guard<std::mutex> lock(spare_mutex);
+        spare_exiting = true;
+        spare_cv.notify_all();
+      }
+      spare_thread.join();
+      spare_isolate.reset();
+
       v8::V8::Dispose();
       v8::V8::ShutdownPlatform();
+      delete[] snapshot.data;
     }
-};
 
-class VeryBadArrayBufferAllocator : public v8::ArrayBuffer::Allocator {
-    void* Allocate(size_t length) override { return NULL; }
-    void* AllocateUninitialized(size_t length) override { return NULL; }
-    void Free(void* data, size_t) override { }
-};
+    CodeCache::Stats code_cache_stats() { return code_cache.stats(); }
+    ResultCache::Stats result_cache_stats() { return result_cache.stats(); }
+    bool memoizes() const { return result_cache.enabled(); }
+    bool traces() const { return trace_log.enabled(); }
+    void flush_trace_log() { trace_log.flush(); }
 
-typedef uint64_t (*UsedCpuTimeCallback)(void *data);
-class CpuWatchdog {
-  private:
-    v8::Isolate *isolate;
-    enum class Status { disabled, should_watch, triggered, should_exit };
-    std::mutex mutex;
-    std::condition_variable cv;
-    Status status = Status::disabled;
-    UsedCpuTimeCallback used_cpu_time_callback;
-    void *used_cpu_time_callback_data;
-    uint64_t limit;
-    std::thread thread;
-
-    void thread_main()
-    {
-      std::chrono::nanoseconds next_check = std::chrono::hours(1);
-      while (true) {
-        std::unique_lock<std::mutex> lock(this->mutex);
-        this->cv.wait_for(lock, next_check);
-        // after the wait, we own the lock.
-        switch (this->status) {
-          case Status::disabled:
-          case Status::triggered:
-            next_check = std::chrono::hours(1);
-            break;
-          case Status::should_exit:
-            return;
-          case Status::should_watch:
-            uint64_t used_cpu_time = (*used_cpu_time_callback)(used_cpu_time_callback_data);
-            if (used_cpu_time >= this->limit) {
-              this->isolate->TerminateExecution();
-              this->status = Status::triggered;
-            } else {
-              next_check = std::chrono::nanoseconds(this->limit - used_cpu_time);
-            }
-        }
-      }
-    }
+    // For a new worker thread to record its metrics in.
+    ThreadMetrics &add_thread_metrics() { return metrics.add_thread(); }
 
-  public:
-    CpuWatchdog(v8::Isolate *isolate):
-        isolate(isolate),
-        thread(std::thread(&CpuWatchdog::thread_main, this))
+    // The fields of a JSON object with the metrics of all threads and the
+    // caches.
+    void write_stats_json(std::ostream &out)
     {
+      metrics.write_json(out);
+
+      CodeCache::Stats code = code_cache_stats();
+      out << ",\"code_cache\":{\"hits\":" << code.hits << ",\"disk_hits\":" << code.disk_hits
+          << ",\"misses\":" << code.misses << ",\"rejections\":" << code.rejections << ",\"evictions\":" << code.evictions
+          << ",\"entries\":" << code.entries << ",\"size\":" << code.size << "}";
+
+      ResultCache::Stats result = result_cache_stats();
+      out << ",\"result_cache\":{\"hits\":" << result.hits << ",\"misses\":" << result.misses
+          << ",\"evictions\":" << result.evictions << ",\"expirations\":" << result.expirations
+          << ",\"entries\":" << result.entries << ",\"size\":" << result.size << "}";
+
+      if (script_profiles.enabled()) {
+        out << ",\"profile\":";
+        script_profiles.write_json(out);
+      }
     }
 
-    void arm(uint64_t limit, UsedCpuTimeCallback used_cpu_time_callback, void *used_cpu_time_callback_data)
+    // The spare isolate if there is one ready, for a thread to replace its
+    // own with. Otherwise nullptr, but there will be one later.
+    OwnedIsolate take_spare_isolate()
     {
-      std::lock_guard<std::mutex> lock(mutex);
-      assert(status == Status::disabled);
-      status = Status::should_watch;
-      this->used_cpu_time_callback = used_cpu_time_callback;
-      this->used_cpu_time_callback_data = used_cpu_time_callback_data;
-      this->limit = limit;
-      cv.notify_all();
+      std::lock_guard<std::mutex> lock(spare_mutex);
+      OwnedIsolate isolate = std::move(spare_isolate);
+      if (!spare_wanted && !spare_isolate) {
+        spare_wanted = true;
+        spare_cv.notify_one();
+      }
+      return isolate;
     }
+};
 
-    bool disarm()
+// Native functions referenced from the startup snapshot.
+const intptr_t *external_references(); // defined after RequestContext
+
+inline bool is_ascii(const char *data, size_t length)
+{
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    if (word & 0x8080808080808080ull)
+      return false;
+  }
+  for (; i < length; i++) {
+    if (data[i] & 0x80)
+      return false;
+  }
+  return true;
+}
+
+// A request body that V8 reads in place instead of copying it onto its heap.
+// When V8 is done with it (which happens on the isolate's thread, during GC
+// or isolate disposal), the buffer is returned to the thread as its spare, so
+// the next large request does not have to grow a fresh one.
+class ExternalRequestString : public v8::String::ExternalOneByteStringResource {
+  private:
+    std::string body;
+    std::string *spare;
+
+  public:
+    ExternalRequestString(std::string &&body, std::string *spare) :
+        body(std::move(body)),
+        spare(spare)
     {
-      std::lock_guard<std::mutex> lock(mutex);
-      bool fired;
-      switch (status) {
-        case Status::should_watch: fired = false; break;
-        case Status::triggered:    fired = true; break;
-        default: throw_with_trace(std::runtime_error("Unexpected watchdog status"));
-      }
-      status = Status::disabled;
-      this->used_cpu_time_callback = nullptr;
-      this->used_cpu_time_callback_data = nullptr;
-      return fired;
     }
 
-    ~CpuWatchdog()
+    const char *data() const override { return body.data(); }
+    size_t length() const override { return body.length(); }
+
+    void Dispose() override
     {
-      {
-        std::lock_guard<std::mutex> lock(mutex);
-        status = Status::should_exit;
-        cv.notify_all();
+      if (spare->capacity() < body.capacity()) {
+        body.clear();
+        spare->swap(body);
       }
-      thread.join();
+      delete this;
     }
 };
 
 class ThreadContext {
+  friend class GlobalContext;
   friend class RequestContext;
   private:
-    // The isolate gets deleted by its {Dispose} method, not by the default
-    // deleter. Therefore we have to define a custom deleter for the unique_ptr to
-    // call {Dispose}. We have to use the unique_ptr so that the isolate get
-    // disposed in the right order, relative to other member variables.
-    struct IsolateDeleter {
-      void operator()(v8::Isolate* isolate) const { isolate->Dispose(); }
-    };
-
-    clockid_t clockid;
-    VeryBadArrayBufferAllocator allocator;
-    std::unique_ptr<v8::Isolate, IsolateDeleter> isolate_owning;
+    // Smaller requests are copied onto the V8 heap, larger pure-ASCII ones
+    // are handed to V8 as external strings.
+    static constexpr size_t kExternalRequestMinLength = 64 * 1024;
+
+    // Per-thread I/O buffers, reused by all requests. They are declared before
+    // the isolate, because disposing it may hand back a request buffer.
+    std::string request_buffer;
+    std::string spare_request_buffer;
+    std::string response_buffer;
+
+    GlobalContext *global;
+    ThreadMetrics *metrics;
+    CpuClock cpu_clock;
+    OwnedIsolate isolate_owning;
     v8::Isolate *isolate;
     v8::Isolate::Scope isolate_scope;
     v8::HandleScope handle_scope;
-    CpuWatchdog cpu_watchdog;
-    uint64_t current_gc_start = 0;
-    uint64_t gc_total = 0;
+    CpuWatchdog::Slot watchdog_slot;
+    OwnedCpuProfiler cpu_profiler; // created for the first profiled request
     bool heap_limit_enabled = false;
     bool heap_limit_exceeded = false;
+    bool heap_limit_reached = false; // ever, the isolate should be replaced
+    uint64_t requests_handled = 0;
+
+    // The datasets live in a context of their own, shared by all requests,
+    // and are passed to user code as a context extension. Where they are in
+    // the startup snapshot:
+    static constexpr size_t kSnapshotDatasetsContextIndex = 1;
+    static constexpr size_t kSnapshotDatasetsIndex = 0;
+    v8::Local<v8::Object> datasets;
+
+    // For requests with "lazy_context": true.
+    LazyJson lazy_json;
+
+    // User contexts (with their implicit context objects) created from the
+    // snapshot ahead of time, while idle.
+    struct ReadyContext {
+      v8::Global<v8::Context> context;
+      v8::Global<v8::Object> implicit_context;
+    };
+    static constexpr size_t kReadyContexts = 2;
+    std::vector<ReadyContext> ready_contexts;
+    void create_user_context(v8::Local<v8::Context> &context, v8::Local<v8::Object> &implicit_context); // defined after RequestContext
+
+    // For requests with "pure": true, the request indexed natively and its
+    // key in the result cache.
+    JsonTape request_tape;
+    std::string result_key;
+
+    // Registered scripts this isolate has used, with their source on its
+    // heap. The registry's entry is referenced weakly, so that scripts
+    // unregistered (or registered anew) elsewhere are noticed.
+    struct ThreadScript {
+      std::weak_ptr<const RegisteredScript> script;
+      v8::Global<v8::String> source;
+    };
+    std::unordered_map<std::string, ThreadScript> scripts;
+    uint64_t scripts_generation = 0;
 
-    // We use a separate context for serializing our JSON responses, because
-    // we don't want toJSON() or some other weirdness breaking the protocol.
-    v8::Local<v8::Context> response_context;
-
-    static std::unique_ptr<v8::Isolate, IsolateDeleter> create_isolate(v8::ArrayBuffer::Allocator *allocator)
-    {
-      v8::ResourceConstraints resource_constraints;
-      resource_constraints.set_max_semi_space_size_in_kb(1024);
-      resource_constraints.set_max_old_space_size(64);
+    // Heap statistics are not free to gather, they are looked at every this
+    // many requests.
+    static constexpr uint64_t kHeapStatisticsInterval = 100;
 
-      v8::Isolate::CreateParams create_params;
-      create_params.constraints = resource_constraints;
-      create_params.array_buffer_allocator = allocator;
+    // V8's default stack size (--stack-size).
+    static constexpr uintptr_t kStackSize = 984 * 1024;
 
-      return std::unique_ptr<v8::Isolate, IsolateDeleter>(v8::Isolate::New(create_params));
+    // An isolate created on another thread, checking the stack of this one.
+    static OwnedIsolate adopt_isolate(OwnedIsolate &&isolate)
+    {
+      char stack_position;
+      isolate->SetStackLimit(reinterpret_cast<uintptr_t>(&stack_position) - kStackSize);
+      return std::move(isolate);
     }
 
   public:
-    ThreadContext() :
-        isolate_owning(create_isolate(&allocator)),
+    // Creates an isolate, unless given one (e.g. the spare).
+    ThreadContext(GlobalContext *global, ThreadMetrics *metrics, OwnedIsolate &&given_isolate = nullptr) :
+        global(global),
+        metrics(metrics),
+        isolate_owning(given_isolate ? adopt_isolate(std::move(given_isolate)) : global->create_isolate()),
         isolate(isolate_owning.get()),
         isolate_scope(isolate),
         handle_scope(isolate),
-        cpu_watchdog(isolate),
-        response_context(v8::Context::New(isolate))
+        watchdog_slot(global->cpu_watchdog, isolate, cpu_clock),
+        datasets(v8::Context::FromSnapshot(isolate, kSnapshotDatasetsContextIndex).ToLocalChecked()
+                   ->GetDataFromSnapshotOnce<v8::Object>(kSnapshotDatasetsIndex).ToLocalChecked()),
+        lazy_json(isolate)
     {
-      if (pthread_getcpuclockid(pthread_self(), &(this->clockid)) != 0)
-        throw_with_trace(std::system_error(errno, std::generic_category(), "Cannot get clock id"));
-
       isolate->SetData(1, this);
 
+      harden_datasets(datasets);
+
       isolate->SetFatalErrorHandler([](const char *location, const char *message) {
         ThreadContext *self = static_cast<ThreadContext *>(v8::Isolate::GetCurrent()->GetData(1));
         assert(self != nullptr);
@@ -189,24 +350,21 @@ class ThreadContext {
         ThreadContext *self = static_cast<ThreadContext *>(v8::Isolate::GetCurrent()->GetData(1));
         assert(self != nullptr);
 
-        assert(self->current_gc_start == 0);
-        self->current_gc_start = self->current_cpu_time();
+        self->cpu_clock.gc_prologue();
       });
 
       isolate->AddGCEpilogueCallback([](v8::Isolate *isolate, v8::GCType type, v8::GCCallbackFlags flags) {
         ThreadContext *self = static_cast<ThreadContext *>(v8::Isolate::GetCurrent()->GetData(1));
         assert(self != nullptr);
 
-        assert(self->current_gc_start != 0);
-        uint64_t now = self->current_cpu_time();
-        self->gc_total += now - self->current_gc_start;
-        self->current_gc_start = 0;
+        self->cpu_clock.gc_epilogue();
       });
 
       isolate->AddNearHeapLimitCallback([](void *data, size_t current_heap_limit, size_t initial_heap_limit) {
         ThreadContext *self = static_cast<ThreadContext *>(v8::Isolate::GetCurrent()->GetData(1));
         assert(self != nullptr);
 
+        self->heap_limit_reached = true;
         if (self->heap_limit_enabled) {
           self->heap_limit_exceeded = true;
           self->isolate->TerminateExecution();
@@ -220,91 +378,380 @@ class ThreadContext {
     {
     }
 
-    uint64_t current_cpu_time()
+    // Whether the isolate has served long enough (or come close to running
+    // out of memory) that it should be replaced with a new one. Every
+    // kHeapStatisticsInterval requests, updates the heap metrics and checks
+    // the heap size on the way.
+    bool due_for_recycling()
+    {
+      if (heap_limit_reached)
+        return true;
+      if (global->recycle_requests != 0 && requests_handled >= global->recycle_requests)
+        return true;
+      if (requests_handled % kHeapStatisticsInterval != 0)
+        return false;
+
+      v8::HeapStatistics statistics;
+      isolate->GetHeapStatistics(&statistics);
+      metrics->used_heap_size.set(statistics.used_heap_size());
+      metrics->total_heap_size.set(statistics.total_heap_size());
+      metrics->heap_size_limit.set(statistics.heap_size_limit());
+      metrics->external_memory.set(statistics.external_memory());
+      return global->recycle_heap_size != 0 && statistics.total_heap_size() >= global->recycle_heap_size;
+    }
+
+    v8::CpuProfiler *profiler()
+    {
+      if (!cpu_profiler) {
+        cpu_profiler.reset(v8::CpuProfiler::New(isolate));
+        cpu_profiler->SetSamplingInterval(ScriptProfiles::kSamplingInterval);
+      }
+      return cpu_profiler.get();
+    }
+
+    // A fresh user context for a request, ready-made if there is one.
+    void take_user_context(v8::Local<v8::Context> &context, v8::Local<v8::Object> &implicit_context); // defined after RequestContext
+
+    // Work for between requests, while none is waiting, so that it is not
+    // done in the middle of the next one: creating user contexts for the
+    // next requests, then letting V8 collect garbage for the rest of the
+    // time given.
+    void idle(std::chrono::milliseconds budget); // defined after RequestContext
+
+    // The buffer to read the next request into. Its capacity is kept between
+    // requests.
+    std::string &next_request_buffer()
+    {
+      request_buffer.clear();
+      return request_buffer;
+    }
+
+    // The source of a registered script, created on this isolate's heap on
+    // first use.
+    v8::Local<v8::String> script_source(const std::string &id, const std::shared_ptr<const RegisteredScript> &script)
+    {
+      uint64_t generation = global->scripts.current_generation();
+      if (generation != scripts_generation) {
+        for (auto it = scripts.begin(); it != scripts.end();)
+          it = it->second.script.expired() ? scripts.erase(it) : std::next(it);
+        scripts_generation = generation;
+      }
+
+      ThreadScript &thread_script = scripts[id];
+      if (thread_script.script.lock() != script) {
+        thread_script.script = script;
+        thread_script.source.Reset(isolate, v8::String::NewFromUtf8(isolate, script->code.data(), v8::NewStringType::kNormal, script->code.size()).ToLocalChecked());
+      }
+      return thread_script.source.Get(isolate);
+    }
+
+    // Returns how much of the heap the datasets take, 0 if there are none.
+    static size_t add_datasets_to_snapshot(v8::SnapshotCreator &creator, const std::vector<Dataset> &datasets)
+    {
+      v8::Isolate *isolate = creator.GetIsolate();
+      v8::HandleScope handle_scope(isolate);
+      v8::Local<v8::Context> context = v8::Context::New(isolate);
+      size_t heap_size = 0;
+      if (!datasets.empty())
+        heap_size = used_heap_size(isolate);
+      v8::Local<v8::Object> loaded = load_datasets(context, datasets);
+      if (!datasets.empty())
+        heap_size = std::max(used_heap_size(isolate), heap_size) - heap_size;
+      size_t index = creator.AddData(context, loaded);
+      assert(index == kSnapshotDatasetsIndex);
+      index = creator.AddContext(context);
+      assert(index == kSnapshotDatasetsContextIndex);
+      return heap_size;
+    }
+
+    // After collecting all garbage.
+    static size_t used_heap_size(v8::Isolate *isolate)
     {
-      struct timespec time;
-      if (clock_gettime(clockid, &time) != 0)
-        throw_with_trace(std::system_error(errno, std::generic_category(), "Cannot get time"));
-      return time.tv_sec * 1e9 + time.tv_nsec;
+      v8::HeapStatistics heap_statistics;
+      isolate->LowMemoryNotification();
+      isolate->GetHeapStatistics(&heap_statistics);
+      return heap_statistics.used_heap_size();
     }
 
 };
 
 class RequestContext {
+  friend class GlobalContext;
+  friend class ThreadContext;
+  friend const intptr_t *external_references();
   private:
+    // Where the prepared user context and its implicit context object are in
+    // the startup snapshot.
+    static constexpr size_t kSnapshotUserContextIndex = 0;
+    static constexpr size_t kSnapshotImplicitContextIndex = 0;
+
     ThreadContext *thread;
     v8::HandleScope handle_scope;
     v8::Local<v8::Context> user_context;
+    v8::Local<v8::Object> implicit_context;
     uint64_t start = 0;
     uint64_t gc_total_at_start = 0;
-    std::unique_ptr<v8::String::Utf8Value> response_utf8;
+
+    // Requests are answered in the encoding they were sent in.
+    enum class Encoding { json, msgpack };
+    Encoding encoding = Encoding::json;
+    size_t response_start = 0; // where in thread->response_buffer, batch items go after each other
+    uint64_t total_time = 0; // of all batch items
+    std::shared_ptr<const std::string> prepared_response; // instead of the above: memoized, or not evaluated at all
+    bool deterministic = false; // the response only depends on the request, it ran to completion
+    Outcome outcome = Outcome::success; // of the request as a whole, for metrics
+    RequestTimings timings;
+    bool timings_requested = false; // "timings": true, for the response at hand (not batch items)
+    bool profiled = false; // runs are added to the script profiles
+    uint64_t error_time = 0; // in ns, of writing error responses (formatting exceptions included)
 
   public:
     RequestContext(ThreadContext *thread) :
         thread(thread),
-        handle_scope(thread->isolate),
-        user_context(v8::Context::New(thread->isolate))
+        handle_scope(thread->isolate)
     {
+      uint64_t request_number = thread->requests_handled++;
+      if (thread->global->trace_log.sample(request_number))
+        timings.trace();
+      profiled = thread->global->script_profiles.sample(request_number);
+      thread->take_user_context(user_context, implicit_context);
       user_context->SetAlignedPointerInEmbedderData(1, this);
     }
 
     ~RequestContext()
     {
+      if (timings.is_traced())
+        thread->global->trace_log.write(timings, outcome_name(outcome));
     }
 
-    void handle_request(const char *request_blob, char *&response_blob, size_t &response_blob_length)
+    // Evaluates the request, which waited queue_wait ns for this thread. The
+    // body may be taken over by V8, in which case the buffer is left with
+    // different contents. Only requests found to be pure beforehand (see
+    // SchedulingHints) are considered for memoization.
+    void handle_request(std::string &request_blob, uint64_t queue_wait = 0, bool pure = false)
     {
-      v8::Local<v8::String> response_string = handle_request_string(request_blob);
+      record_queue_wait(queue_wait);
+      encoding = msgpack::is_msgpack(request_blob) ? Encoding::msgpack : Encoding::json;
+      if (!pure || !wants_memoization(request_blob)) {
+        handle_request_blob(request_blob);
+        return thread->metrics->count(outcome);
+      }
+
+      ResultCache &result_cache = thread->global->result_cache;
+      if ((prepared_response = result_cache.lookup(thread->result_key)))
+        return thread->metrics->count(outcome = Outcome::memoized);
+      handle_request_blob(request_blob);
+      thread->metrics->count(outcome);
+      if (deterministic) {
+        auto response = std::make_shared<std::string>();
+        response->reserve(response_length());
+        write_response([&](const char *data, size_t length) { response->append(data, length); });
+        result_cache.insert(thread->result_key, response);
+        prepared_response = std::move(response);
+      }
+    }
+
+    // Answers a request that waited too long to be started, without
+    // evaluating it.
+    void handle_overdue_request(const std::string &request_blob, uint64_t queue_wait = 0)
+    {
+      record_queue_wait(queue_wait);
+      static const auto json = std::make_shared<const std::string>(
+          "{\"status\":\"overloaded\",\"detail\":\"Request could not be started before its deadline.\"}");
+      static const auto msgpack = []{
+        auto response = std::make_shared<std::string>();
+        msgpack::Writer writer(*response);
+        writer.map_header(2);
+        writer.string("status");
+        writer.string("overloaded");
+        writer.string("detail");
+        writer.string("Request could not be started before its deadline.");
+        return std::shared_ptr<const std::string>(response);
+      }();
+
+      encoding = msgpack::is_msgpack(request_blob) ? Encoding::msgpack : Encoding::json;
+      prepared_response = encoding == Encoding::msgpack ? msgpack : json;
+      thread->metrics->count(outcome = Outcome::overloaded);
+    }
+
+    // Where the time of the request went, so far.
+    const RequestTimings &phase_timings() const { return timings; }
+
+    // Of the time outside the phases, how much went into writing error
+    // responses, in ns.
+    uint64_t error_response_time() const { return error_time; }
+
+    // Length of the response in bytes.
+    size_t response_length()
+    {
+      if (prepared_response)
+        return prepared_response->size();
+      return thread->response_buffer.size();
+    }
+
+    // Hands the response to write(const char *data, size_t length). Both
+    // encodings are built natively in thread->response_buffer (unless
+    // prepared), so there is nothing left to convert. Whoever sends the
+    // response on records the time it took with responded().
+    template <class Write>
+    void write_response(Write &&write)
+    {
+      if (prepared_response)
+        write(static_cast<const char *>(prepared_response->data()), prepared_response->size());
+      else
+        write(static_cast<const char *>(thread->response_buffer.data()), thread->response_buffer.size());
+    }
 
-      // Convert to UTF-8 and return
-      response_utf8 = std::make_unique<v8::String::Utf8Value>(thread->isolate, response_string); // TODO: do not buffer
-      response_blob = **response_utf8;
-      response_blob_length = response_utf8->length();
+    // Hands the response over for sending elsewhere, without copying it:
+    // returns it if prepared (and shared), otherwise swaps it into buffer,
+    // leaving buffer's old contents to the thread to build the next one in.
+    std::shared_ptr<const std::string> take_response(std::string &buffer)
+    {
+      if (prepared_response)
+        return prepared_response;
+      buffer.swap(thread->response_buffer);
+      return nullptr;
+    }
+
+    // Records the respond phase, from begin until now.
+    void responded(RequestTimings::Clock::time_point begin)
+    {
+      timings.record(Phase::respond, begin, RequestTimings::Clock::now());
     }
 
   private:
-    // Called from watchdog thread as well.
+
+    /* Implicit context */
+
+    // Prepares the user context and the implicit context object that is
+    // visible to the code, when creating the startup snapshot. Requests get
+    // a copy of both, ready to use.
+    static void add_user_context_to_snapshot(v8::SnapshotCreator &creator)
+    {
+      v8::Isolate *isolate = creator.GetIsolate();
+      v8::HandleScope handle_scope(isolate);
+      v8::Local<v8::Context> context = v8::Context::New(isolate);
+      v8::Context::Scope context_scope(context);
+
+      v8::Local<v8::Object> implicit_context = v8::Object::New(isolate);
+      implicit_context->Set(context, v8::String::NewFromUtf8(isolate, "global", v8::NewStringType::kInternalized).ToLocalChecked(), context->Global()).ToChecked();
+      bool tmp = implicit_context->SetNativeDataProperty(context, v8::String::NewFromUtf8(isolate, "cputime", v8::NewStringType::kInternalized).ToLocalChecked(), cputime_getter).ToChecked();
+      assert(tmp == true);
+
+      size_t index = creator.AddData(context, implicit_context);
+      assert(index == kSnapshotImplicitContextIndex);
+      index = creator.AddContext(context);
+      assert(index == kSnapshotUserContextIndex);
+    }
+
+    static void cputime_getter(v8::Local<v8::Name> property, const v8::PropertyCallbackInfo<v8::Value> &info)
+    {
+      v8::Local<v8::Context> context = info.GetIsolate()->GetCurrentContext();
+      RequestContext *request_context = static_cast<RequestContext *>(context->GetAlignedPointerFromEmbedderData(1));
+      uint32_t used_time_ms = (request_context->used_cpu_time() + 1e6 - 1) / 1e6;
+      info.GetReturnValue().Set(used_time_ms);
+    }
+
     uint64_t used_cpu_time()
     {
-      uint64_t now = thread->current_gc_start ? thread->current_gc_start : this->thread->current_cpu_time();
-      return now - start - (thread->gc_total - gc_total_at_start);
+      return thread->cpu_clock.used_since(start, gc_total_at_start);
+    }
+
+    void record_queue_wait(uint64_t queue_wait)
+    {
+      RequestTimings::Clock::time_point now = RequestTimings::Clock::now();
+      timings.record(Phase::queue, now - std::chrono::nanoseconds(queue_wait), now);
     }
 
-    v8::Local<v8::String> handle_request_string(const char *request_blob)
+    void handle_request_blob(std::string &request_blob)
     {
       assert(start == 0); // Another request already contaminated this RequestContext, create a new one.
+      RequestTimings::Clock::time_point parse_start = RequestTimings::Clock::now();
 
       v8::Context::Scope context_scope(user_context);
       v8::TryCatch try_catch(thread->isolate);
 
       // Parse the request.
       v8::Local<v8::Object> request_context;
+      v8::Local<v8::Array> request_contexts; // batch requests
       v8::Local<v8::String> request_code;
+      std::shared_ptr<const RegisteredScript> script; // if invoked by ID
       uint32_t timeout_millis;
       {
-        v8::Local<v8::String> request_string;
-        if (!v8::String::NewFromUtf8(thread->isolate, request_blob, v8::NewStringType::kNormal).ToLocal(&request_string))
-          return error_response("bad_request", v8_istr("Request is not valid UTF-8."));
-
         v8::Local<v8::Value> request_value;
-        if (!v8::JSON::Parse(user_context, request_string).ToLocal(&request_value))
-          return error_response("bad_request", v8_istr("Request is not valid JSON."));
+        if (encoding == Encoding::msgpack) {
+          msgpack::Decoder decoder(user_context, request_blob);
+          if (!decoder.decode(request_value))
+            return error_response("bad_request", decoder.error);
+        } else if (wants_lazy_context(request_blob)) {
+          if (!thread->lazy_json.root(user_context).ToLocal(&request_value))
+            return error_response("bad_request", "Request is too large.");
+        } else {
+          v8::Local<v8::String> request_string;
+          if (request_blob.length() >= ThreadContext::kExternalRequestMinLength && is_ascii(request_blob.data(), request_blob.length())) {
+            std::string body;
+            body.swap(request_blob);
+            request_blob.swap(thread->spare_request_buffer);
+            if (!v8::String::NewExternalOneByte(thread->isolate, new ExternalRequestString(std::move(body), &thread->spare_request_buffer)).ToLocal(&request_string))
+              return error_response("bad_request", "Request is too large.");
+          } else if (!v8::String::NewFromUtf8(thread->isolate, request_blob.data(), v8::NewStringType::kNormal, request_blob.length()).ToLocal(&request_string)) {
+            return error_response("bad_request", "Request is not valid UTF-8.");
+          }
+
+          if (!v8::JSON::Parse(user_context, request_string).ToLocal(&request_value))
+            return error_response("bad_request", "Request is not valid JSON.");
+        }
 
         if (!request_value->IsObject() || request_value->IsArray())
-          return error_response("bad_request", v8_istr("Request is not an object."));
+          return error_response("bad_request", "Request is not an object.");
         v8::Local<v8::Object> request_object = v8::Local<v8::Object>::Cast(request_value);
 
-        v8::Local<v8::Value> request_context_value;
-        if (!request_object->Get(user_context, v8_istr("context")).ToLocal(&request_context_value) ||
-            !request_context_value->IsObject())
-          return error_response("bad_request", v8_istr("Missing 'context' parameter or it is not an object."));
-        request_context = v8::Local<v8::Object>::Cast(request_context_value);
+        v8::Local<v8::Value> op_value = request_object->Get(user_context, v8_istr("op")).ToLocalChecked();
+        if (!op_value->IsUndefined()) {
+          if (op_value->StrictEquals(v8_istr("register")))
+            return register_script(request_object, &try_catch);
+          if (op_value->StrictEquals(v8_istr("unregister")))
+            return unregister_script(request_object);
+          return error_response("bad_request", "Unknown 'op' parameter.");
+        }
 
-        v8::Local<v8::Value> request_code_value;
-        if (!request_object->Get(user_context, v8_istr("code")).ToLocal(&request_code_value) ||
-            !request_code_value->IsString())
-          return error_response("bad_request", v8_istr("Missing 'code' parameter or it is not a string."));
-        request_code = v8::Local<v8::String>::Cast(request_code_value);
+        v8::Local<v8::Value> request_contexts_value = request_object->Get(user_context, v8_istr("contexts")).ToLocalChecked();
+        if (request_contexts_value->IsUndefined()) {
+          v8::Local<v8::Value> request_context_value;
+          if (!request_object->Get(user_context, v8_istr("context")).ToLocal(&request_context_value) ||
+              !request_context_value->IsObject())
+            return error_response("bad_request", "Missing 'context' parameter or it is not an object.");
+          request_context = v8::Local<v8::Object>::Cast(request_context_value);
+        } else {
+          if (!request_object->Get(user_context, v8_istr("context")).ToLocalChecked()->IsUndefined())
+            return error_response("bad_request", "Only one of 'context' and 'contexts' may be given.");
+          if (!request_contexts_value->IsArray())
+            return error_response("bad_request", "'contexts' parameter must be an array of objects.");
+          request_contexts = v8::Local<v8::Array>::Cast(request_contexts_value);
+          for (uint32_t i = 0; i < request_contexts->Length(); i++) {
+            if (!request_contexts->Get(user_context, i).ToLocalChecked()->IsObject())
+              return error_response("bad_request", "'contexts' parameter must be an array of objects.");
+          }
+        }
+
+        v8::Local<v8::Value> script_id_value = request_object->Get(user_context, v8_istr("script_id")).ToLocalChecked();
+        if (script_id_value->IsUndefined()) {
+          v8::Local<v8::Value> request_code_value;
+          if (!request_object->Get(user_context, v8_istr("code")).ToLocal(&request_code_value) ||
+              !request_code_value->IsString())
+            return error_response("bad_request", "Missing 'code' parameter or it is not a string.");
+          request_code = v8::Local<v8::String>::Cast(request_code_value);
+        } else {
+          if (!script_id_value->IsString())
+            return error_response("bad_request", "'script_id' parameter must be a string.");
+          if (!request_object->Get(user_context, v8_istr("code")).ToLocalChecked()->IsUndefined())
+            return error_response("bad_request", "Only one of 'code' and 'script_id' may be given.");
+          v8::String::Utf8Value script_id_utf8(thread->isolate, script_id_value);
+          std::string script_id(*script_id_utf8, script_id_utf8.length());
+          if (!(script = thread->global->scripts.find(script_id)))
+            return error_response("bad_request", "Unknown 'script_id'.");
+          request_code = thread->script_source(script_id, script);
+        }
 
         v8::Local<v8::Value> timeout_value = request_object->Get(user_context, v8_istr("timeout")).ToLocalChecked();
         if (timeout_value->IsUndefined()) {
@@ -312,160 +759,593 @@ class RequestContext {
         } else if (timeout_value->IsUint32()) {
           timeout_millis = v8::Local<v8::Uint32>::Cast(timeout_value)->Value();
           if (timeout_millis == 0)
-            return error_response("bad_request", v8_istr("'timeout' parameter must be a positive integer."));
+            return error_response("bad_request", "'timeout' parameter must be a positive integer.");
         } else {
-          return error_response("bad_request", v8_istr("'timeout' parameter must be a positive integer."));
+          return error_response("bad_request", "'timeout' parameter must be a positive integer.");
         }
+
+        // Only used for scheduling, before the request gets here.
+        v8::Local<v8::Value> deadline_value = request_object->Get(user_context, v8_istr("deadline")).ToLocalChecked();
+        if (!deadline_value->IsUndefined() && !(deadline_value->IsUint32() && v8::Local<v8::Uint32>::Cast(deadline_value)->Value() > 0))
+          return error_response("bad_request", "'deadline' parameter must be a positive integer.");
+        v8::Local<v8::Value> priority_value = request_object->Get(user_context, v8_istr("priority")).ToLocalChecked();
+        if (!priority_value->IsUndefined() && !priority_value->StrictEquals(v8_istr("interactive")) && !priority_value->StrictEquals(v8_istr("batch")))
+          return error_response("bad_request", "'priority' parameter must be \"interactive\" or \"batch\".");
+
+        v8::Local<v8::Value> timings_value = request_object->Get(user_context, v8_istr("timings")).ToLocalChecked();
+        if (!timings_value->IsUndefined() && !timings_value->IsBoolean())
+          return error_response("bad_request", "'timings' parameter must be a boolean.");
+        timings_requested = timings_value->IsTrue();
+      }
+      timings.record(Phase::parse, parse_start, RequestTimings::Clock::now());
+
+      // Prepare the source code, with its code cache data if we have it.
+      Code code{request_code, script != nullptr};
+      CodeCache &code_cache = thread->global->code_cache;
+      if (script) {
+        code.cache_data = script->code_cache_data;
+      } else if (code_cache.enabled()) {
+        v8::String::Utf8Value code_utf8(thread->isolate, request_code);
+        code.cache_key.assign(*code_utf8, code_utf8.length());
+        code.cache_data = code_cache.lookup(code.cache_key, code.worth_inserting);
       }
 
-      // Prepare the source code.
+      deterministic = true;
+      if (request_contexts.IsEmpty())
+        return run(user_context, implicit_context, request_context, code, timeout_millis);
+      return run_batch(request_contexts, code, timeout_millis);
+    }
+
+    // The code to run, and what the code cache knows about it.
+    struct Code {
+      v8::Local<v8::String> source;
+      bool registered; // cache data comes from the script registry
+      std::string cache_key;
+      std::shared_ptr<const std::string> cache_data;
+      bool worth_inserting = false; // into the code cache
+      bool reused = false; // by more batch items
+    };
+
+    // Runs the code in the given context, and responds with its outcome.
+    void run(v8::Local<v8::Context> context, v8::Local<v8::Object> implicit_context, v8::Local<v8::Object> request_context, Code &code, uint32_t timeout_millis)
+    {
+      v8::Context::Scope context_scope(context);
+      v8::TryCatch try_catch(thread->isolate);
+
       v8::ScriptOrigin origin(v8_istr("<user-code>"));
-      v8::ScriptCompiler::Source source(request_code, origin);
-
-      // Prepare the implicit context.
-      v8::Local<v8::Object> implicit_context = v8::Object::New(thread->isolate);
-      // todo move into ctor
-      implicit_context->Set(user_context, v8_istr("global"), user_context->Global()).ToChecked();
-      bool tmp = implicit_context->SetNativeDataProperty(user_context, v8_istr("cputime"), [](v8::Local<v8::Name> property, const v8::PropertyCallbackInfo<v8::Value> &info) {
-        v8::Local<v8::Context> context = info.GetIsolate()->GetCurrentContext();
-        RequestContext *request_context = static_cast<RequestContext *>(context->GetAlignedPointerFromEmbedderData(1));
-        uint32_t used_time_ms = (request_context->used_cpu_time() + 1e6 - 1) / 1e6;
-        info.GetReturnValue().Set(used_time_ms);
-      }).ToChecked();
-      assert(tmp == true);
+      v8::ScriptCompiler::Source source(code.source, origin, !code.cache_data ? nullptr :
+          new v8::ScriptCompiler::CachedData(reinterpret_cast<const uint8_t *>(code.cache_data->data()), code.cache_data->size()));
 
-      // Compile the source code with the implicit and user-provided contexts.
-      v8::Local<v8::Object> context_extensions[] = {implicit_context, request_context};
+      // Compile the source code with the implicit context, datasets and
+      // user-provided context, innermost last.
+      v8::Local<v8::Object> context_extensions[] = {implicit_context, thread->datasets, request_context};
       v8::Local<v8::Function> function;
-      if (!v8::ScriptCompiler::CompileFunctionInContext(user_context, &source, 0, {}, 2, context_extensions).ToLocal(&function))
-        return error_response("code_error", trycatch_to_detail(user_context, &try_catch));
+      v8::ScriptCompiler::CompileOptions compile_options = code.cache_data ? v8::ScriptCompiler::kConsumeCodeCache : v8::ScriptCompiler::kNoCompileOptions;
+      RequestTimings::Clock::time_point compile_start = RequestTimings::Clock::now();
+      bool compiled = v8::ScriptCompiler::CompileFunctionInContext(context, &source, 0, {}, 3, context_extensions, compile_options).ToLocal(&function);
+      RequestTimings::Clock::time_point compile_end = RequestTimings::Clock::now();
+      timings.record(Phase::compile, compile_start, compile_end);
+      thread->metrics->compile.record(std::chrono::duration_cast<std::chrono::nanoseconds>(compile_end - compile_start).count());
+      if (!compiled)
+        return exception_response(context, &try_catch);
+      if (code.cache_data && source.GetCachedData()->rejected) {
+        if (!code.registered) {
+          thread->global->code_cache.reject(code.cache_key);
+          code.worth_inserting = true;
+        }
+        code.cache_data.reset();
+      }
 
       // Run user code
       // 1. Set memory limit
       thread->heap_limit_enabled = true;
       thread->heap_limit_exceeded = false;
 
-      // 2. Set CPU limit
-      this->start = thread->current_cpu_time();
-      this->gc_total_at_start = thread->gc_total;
-      thread->cpu_watchdog.arm(timeout_millis * 1e6, [](void *data){
-        RequestContext *self = static_cast<RequestContext *>(data);
-        return self->used_cpu_time();
-      }, this);
+      // 2. Set CPU limit, after starting the profiler (which takes a while)
+      v8::CpuProfiler *profiler = profiled ? thread->profiler() : nullptr;
+      if (profiler)
+        profiler->StartProfiling(v8_istr("run"));
+      this->start = thread->cpu_clock.now();
+      this->gc_total_at_start = thread->cpu_clock.gc_time();
+      thread->watchdog_slot.arm(timeout_millis * 1e6, start, gc_total_at_start);
 
       // 3. Run
       v8::Local<v8::Value> retval;
       v8::Local<v8::String> retval_stringified;
-      bool success = function->Call(user_context, user_context->Global(), 0, {}).ToLocal(&retval) &&
-                     v8::JSON::Stringify(user_context, retval).ToLocal(&retval_stringified);
+      RequestTimings::Clock::time_point call_start = RequestTimings::Clock::now();
+      bool success = function->Call(context, context->Global(), 0, {}).ToLocal(&retval);
+      RequestTimings::Clock::time_point call_end = RequestTimings::Clock::now();
+      uint64_t call_time = this->used_cpu_time();
+      success = success && serialize_return_value(context, retval, retval_stringified);
       uint64_t used_time = this->used_cpu_time();
+      timings.record(Phase::run, call_start, call_end);
+      timings.record(Phase::serialize, call_end, RequestTimings::Clock::now());
+      total_time += used_time;
 
       // 4. Unset CPU limit (watchdog may still fire until this is finished)
-      bool over_cpu = thread->cpu_watchdog.disarm();
+      bool over_cpu = thread->watchdog_slot.disarm();
       if (over_cpu)
         assert(used_cpu_time() >= timeout_millis * 1e6);
 
       // 5. Unset memory limit
       thread->heap_limit_enabled = false;
 
-      // Prepare response
-      if (thread->isolate->IsExecutionTerminating()) {
+      if (profiler) {
+        v8::CpuProfile *profile = profiler->StopProfiling(v8_istr("run"));
+        if (profile) {
+          v8::String::Utf8Value source_utf8(thread->isolate, code.source);
+          thread->global->script_profiles.add(ScriptRegistry::id_for(std::string(*source_utf8, source_utf8.length())), used_time, profile);
+          profile->Delete();
+        }
+      }
+
+      thread->metrics->run.record(call_time);
+      thread->metrics->serialize.record(used_time - call_time);
+      thread->metrics->gc.record(thread->cpu_clock.gc_time() - gc_total_at_start);
+
+      // Store the compiled code for next time. Done after running, so that
+      // it includes the inner functions that were compiled lazily.
+      if (!code.cache_data && (code.worth_inserting || code.reused) && success && !thread->isolate->IsExecutionTerminating()) {
+        std::unique_ptr<v8::ScriptCompiler::CachedData> data(v8::ScriptCompiler::CreateCodeCacheForFunction(function));
+        if (data) {
+          code.cache_data = std::make_shared<const std::string>(reinterpret_cast<const char *>(data->data), data->length);
+          if (code.worth_inserting)
+            thread->global->code_cache.insert(code.cache_key, std::string(*code.cache_data));
+          code.worth_inserting = false;
+        }
+      }
+
+      // Prepare response. A limit hit in native code (serializing, say) has
+      // terminated nothing yet, but must neither let the request succeed nor
+      // terminate the next one.
+      if (over_cpu || thread->heap_limit_exceeded || thread->isolate->IsExecutionTerminating()) {
         thread->isolate->CancelTerminateExecution();
+        deterministic = false;
         if (thread->heap_limit_exceeded) {
-          return error_response("code_error", v8_istr("Memory limit exceeded."));
+          thread->metrics->memory_limit_exceeded.add(1);
+          return error_response("code_error", "Memory limit exceeded.");
         } else if (over_cpu) {
+          thread->metrics->cpu_limit_exceeded.add(1);
           std::stringstream detail;
           detail << "CPU time limit exceeded (limit " << timeout_millis << " ms, "
                  << "used " << used_time / 1e6 << " ms, "
-                 << "plus " << (this->thread->gc_total - this->gc_total_at_start) / 1e6 << " ms for gc).";
-          return error_response("code_error", v8_str(detail.str().c_str()));
+                 << "plus " << (this->thread->cpu_clock.gc_time() - this->gc_total_at_start) / 1e6 << " ms for gc).";
+          return error_response("code_error", detail.str().c_str());
         } else {
           throw_with_trace(std::runtime_error("Execution terminating but neither over memory or cpu time limits?"));
         }
       } else if (!success) {
-        return error_response("code_error", trycatch_to_detail(user_context, &try_catch));
-      } else if (retval_stringified.IsEmpty()) {
+        return exception_response(context, &try_catch);
+      } else if (encoding == Encoding::json && retval_stringified.IsEmpty()) {
         throw_with_trace(std::runtime_error("Execution succeeded but retval is empty?"));
       }
 
-      // Stringify may return `undefined` in several cases, which is clearly not
-      // valid JSON. Fix that here.
-      if (retval_stringified->Length() == 9) { // convert to UTF-8 only if short
-        v8::String::Utf8Value utf8(thread->isolate, retval_stringified);
-        if (utf8.length() == 9 && strcmp(*utf8, "undefined") == 0)
-          retval_stringified = v8_istr("null");
+      return success_response(retval_stringified, used_time);
+    }
+
+    // Runs the code once for every context, each in a fresh user context of
+    // its own (with a copy of its context object) and under its own limits.
+    // The code is compiled from source at most once, later items load what
+    // the first one compiled. Responds with every item's response, in order.
+    void run_batch(v8::Local<v8::Array> request_contexts, Code &code, uint32_t timeout_millis)
+    {
+      uint32_t count = request_contexts->Length();
+      code.reused = count > 1;
+
+      // The items' responses have no timings, the batch's has them all.
+      bool batch_timings_requested = timings_requested;
+      timings_requested = false;
+
+      msgpack::Writer writer(thread->response_buffer);
+      JsonWriter json(thread->response_buffer);
+      writer.rewind(0);
+      if (encoding == Encoding::msgpack) {
+        writer.map_header(batch_timings_requested ? 4 : 3);
+        writer.string("status");
+        writer.string("success");
+        writer.string("results");
+        writer.array_header(count);
+      } else {
+        json.raw("{\"status\":\"success\",\"results\":[");
       }
 
-      return success_response(retval_stringified, used_time);
+      for (uint32_t i = 0; i < count; i++) {
+        v8::HandleScope handle_scope(thread->isolate);
+        v8::Local<v8::Context> item_context;
+        v8::Local<v8::Object> item_implicit_context;
+        thread->take_user_context(item_context, item_implicit_context);
+        item_context->SetAlignedPointerInEmbedderData(1, this);
+
+        if (encoding == Encoding::json && i != 0)
+          json.raw(',');
+        response_start = writer.size();
+        v8::Local<v8::Value> item_request_context;
+        if (!copy_value(item_context, request_contexts->Get(user_context, i).ToLocalChecked(), 0).ToLocal(&item_request_context))
+          error_response("bad_request", "Context is nested too deeply.");
+        else
+          run(item_context, item_implicit_context, v8::Local<v8::Object>::Cast(item_request_context), code, timeout_millis);
+      }
+
+      uint32_t time_ms = (total_time + 1e6 - 1) / 1e6;
+      response_start = 0;
+      outcome = Outcome::success;
+      timings_requested = batch_timings_requested;
+      if (encoding == Encoding::msgpack) {
+        writer.string("time");
+        writer.integer(time_ms);
+        write_timings(writer);
+        return;
+      }
+      json.raw("],\"time\":");
+      json.integer(time_ms);
+      write_timings(json);
+      json.raw('}');
     }
 
-    /* Response generation */
+    // Copies a value from the request (objects, arrays and primitives, as
+    // created by JSON.parse() or the MessagePack decoder) into a context.
+    v8::MaybeLocal<v8::Value> copy_value(v8::Local<v8::Context> context, v8::Local<v8::Value> value, int depth)
+    {
+      if (!value->IsObject())
+        return value;
+      if (depth >= msgpack::kMaxDepth)
+        return v8::MaybeLocal<v8::Value>();
+
+      v8::EscapableHandleScope handle_scope(thread->isolate);
+      v8::Context::Scope context_scope(context);
+      v8::Local<v8::Value> copy;
+      if (value->IsArray()) {
+        v8::Local<v8::Array> array = v8::Local<v8::Array>::Cast(value);
+        v8::Local<v8::Array> array_copy = v8::Array::New(thread->isolate, array->Length());
+        for (uint32_t i = 0; i < array->Length(); i++) {
+          if (!copy_value(context, array->Get(user_context, i).ToLocalChecked(), depth + 1).ToLocal(&copy))
+            return v8::MaybeLocal<v8::Value>();
+          array_copy->Set(context, i, copy).ToChecked();
+        }
+        return handle_scope.Escape(array_copy);
+      }
 
-    v8::Local<v8::String> success_response(v8::Local<v8::String> retval, uint64_t time)
+      v8::Local<v8::Object> object = v8::Local<v8::Object>::Cast(value);
+      v8::Local<v8::Object> object_copy = v8::Object::New(thread->isolate);
+      v8::Local<v8::Array> keys = object->GetOwnPropertyNames(user_context, static_cast<v8::PropertyFilter>(v8::ONLY_ENUMERABLE | v8::SKIP_SYMBOLS),
+                                                              v8::KeyConversionMode::kConvertToString).ToLocalChecked();
+      for (uint32_t i = 0; i < keys->Length(); i++) {
+        v8::Local<v8::Name> key = v8::Local<v8::Name>::Cast(keys->Get(user_context, i).ToLocalChecked());
+        if (!copy_value(context, object->Get(user_context, key).ToLocalChecked(), depth + 1).ToLocal(&copy))
+          return v8::MaybeLocal<v8::Value>();
+        object_copy->CreateDataProperty(context, key, copy).ToChecked();
+      }
+      return handle_scope.Escape(object_copy);
+    }
+
+    /* Registered scripts */
+
+    void register_script(v8::Local<v8::Object> request_object, v8::TryCatch *try_catch)
     {
-      v8::Local<v8::Context> response_context = thread->response_context;
-      v8::Context::Scope context_scope(response_context);
+      v8::Local<v8::Value> code_value;
+      if (!request_object->Get(user_context, v8_istr("code")).ToLocal(&code_value) ||
+          !code_value->IsString())
+        return error_response("bad_request", "Missing 'code' parameter or it is not a string.");
+      v8::Local<v8::String> code = v8::Local<v8::String>::Cast(code_value);
+
+      auto script = std::make_shared<RegisteredScript>();
+      v8::String::Utf8Value code_utf8(thread->isolate, code);
+      script->code.assign(*code_utf8, code_utf8.length());
+      std::string id = ScriptRegistry::id_for(script->code);
+
+      std::shared_ptr<const RegisteredScript> existing = thread->global->scripts.find(id);
+      if (!existing || existing->code != script->code) {
+        // Compile it here, to report errors now, and so that invocations only
+        // have to load the compiled code.
+        v8::ScriptOrigin origin(v8_istr("<user-code>"));
+        v8::ScriptCompiler::Source source(code, origin);
+        v8::Local<v8::Object> context_extensions[] = {implicit_context, thread->datasets, v8::Object::New(thread->isolate)};
+        v8::Local<v8::Function> function;
+        if (!v8::ScriptCompiler::CompileFunctionInContext(user_context, &source, 0, {}, 3, context_extensions).ToLocal(&function))
+          return exception_response(user_context, try_catch);
+        std::unique_ptr<v8::ScriptCompiler::CachedData> data(v8::ScriptCompiler::CreateCodeCacheForFunction(function));
+        if (data)
+          script->code_cache_data = std::make_shared<const std::string>(reinterpret_cast<const char *>(data->data), data->length);
+
+        switch (thread->global->scripts.add(id, std::move(script))) {
+          case ScriptRegistry::Result::ok:
+            break;
+          case ScriptRegistry::Result::full:
+            return error_response("bad_request", "Registered scripts are over the size limit, unregister some first.");
+          case ScriptRegistry::Result::conflict:
+            return error_response("bad_request", "A different script is registered with the same ID.");
+        }
+      }
 
-      uint32_t time_ms = (time + 1e6 - 1) / 1e6;
+      return script_response(id);
+    }
 
-      std::stringstream time_string;
-      time_string << time_ms;
+    void unregister_script(v8::Local<v8::Object> request_object)
+    {
+      v8::Local<v8::Value> script_id_value = request_object->Get(user_context, v8_istr("script_id")).ToLocalChecked();
+      if (!script_id_value->IsString())
+        return error_response("bad_request", "Missing 'script_id' parameter or it is not a string.");
+      v8::String::Utf8Value script_id_utf8(thread->isolate, script_id_value);
+      std::string id(*script_id_utf8, script_id_utf8.length());
+      if (!thread->global->scripts.remove(id))
+        return error_response("bad_request", "Unknown 'script_id'.");
+      return script_response(id);
+    }
 
-      return v8_concat({ v8_istr("{\"status\":\"success\",\"return_value\":"), retval, v8_istr(",\"time\":"), v8_str(time_string.str().c_str()), v8_istr("}") });
+    // Requests can ask for their context to be created lazily, as it is used,
+    // by setting "lazy_context": true. Such requests are indexed natively and
+    // the request itself is a lazy object. The request buffer must outlive
+    // this RequestContext.
+    bool wants_lazy_context(const std::string &request_blob)
+    {
+      static const char kKey[] = "\"lazy_context\"";
+      return memmem(request_blob.data(), request_blob.length(), kKey, sizeof(kKey) - 1) &&
+             thread->lazy_json.parse(request_blob.data(), request_blob.length()) &&
+             thread->lazy_json.has_true("lazy_context");
     }
 
-    v8::Local<v8::String> error_response(const char *status, v8::Local<v8::String> detail)
+    // Requests can have their response memoized by setting "pure": true, if
+    // the result cache is enabled. Such requests are indexed natively to
+    // build their key, before any V8 work. Unregistering any script changes
+    // all keys, so that results of unregistered scripts are not returned.
+    bool wants_memoization(const std::string &request_blob)
     {
-      v8::Local<v8::Context> response_context = thread->response_context;
-      v8::Context::Scope context_scope(response_context);
+      if (!thread->global->result_cache.enabled())
+        return false;
+      if (encoding == Encoding::msgpack) {
+        if (!result_key_msgpack(request_blob, thread->result_key))
+          return false;
+      } else if (!thread->request_tape.parse(request_blob.data(), request_blob.length()) ||
+                 !result_key_json(thread->request_tape, thread->result_key)) {
+        return false;
+      }
+      uint64_t generation = thread->global->scripts.current_generation();
+      thread->result_key.append(reinterpret_cast<const char *>(&generation), sizeof(generation));
+      return true;
+    }
 
-      v8::Local<v8::Object> response = v8::Object::New(thread->isolate);
-      response->Set(response_context, v8_istr("status"), v8_istr(status)).ToChecked();
-      response->Set(response_context, v8_istr("detail"), detail).ToChecked();
-      return v8::JSON::Stringify(response_context, response).ToLocalChecked();
+    // Runs in the user's context, under the same limits as the code itself,
+    // since toJSON() and getters can run user code. For MessagePack, this
+    // starts the response, success_response() completes it.
+    bool serialize_return_value(v8::Local<v8::Context> context, v8::Local<v8::Value> retval, v8::Local<v8::String> &retval_stringified)
+    {
+      if (encoding == Encoding::msgpack) {
+        msgpack::Writer writer(thread->response_buffer);
+        writer.rewind(response_start);
+        writer.map_header(timings_requested ? 4 : 3);
+        writer.string("status");
+        writer.string("success");
+        writer.string("return_value");
+        return msgpack::Encoder(context, writer).encode(retval);
+      }
+      return v8::JSON::Stringify(context, retval).ToLocal(&retval_stringified);
     }
 
-    v8::Local<v8::String> trycatch_to_detail(v8::Local<v8::Context> tostring_context, v8::TryCatch *try_catch)
+    /* Response generation */
+
+    // Phases so far, if the request asked for them, as the last field of a
+    // response, in ms.
+    void write_timings(msgpack::Writer &writer)
     {
-      v8::Local<v8::String> message_string = v8_istr("<no message>");
-      {
-        v8::Local<v8::Message> message = try_catch->Message();
-        if (!message.IsEmpty()) {
-          char line_string[22];
-          sprintf(line_string, "%d", message->GetLineNumber(tostring_context).FromMaybe(-1));
-          message_string = v8_concat({ message->Get(), v8_istr(" ["), message->GetScriptOrigin().ResourceName()->ToString(tostring_context).ToLocalChecked(), v8_istr(":"), v8_str(line_string), v8_istr("]") });
-        }
+      if (!timings_requested)
+        return;
+      writer.string("timings");
+      writer.map_header(static_cast<size_t>(Phase::respond));
+      for (size_t i = 0; i < static_cast<size_t>(Phase::respond); i++) {
+        writer.string(phase_name(static_cast<Phase>(i)));
+        writer.number(timings.total(static_cast<Phase>(i)) / 1e6);
+      }
+    }
+
+    void write_timings(JsonWriter &json)
+    {
+      if (!timings_requested)
+        return;
+      json.raw(",\"timings\":{");
+      for (size_t i = 0; i < static_cast<size_t>(Phase::respond); i++) {
+        if (i)
+          json.raw(',');
+        json.string(phase_name(static_cast<Phase>(i)));
+        json.raw(':');
+        json.number(timings.total(static_cast<Phase>(i)) / 1e6);
       }
+      json.raw('}');
+    }
 
-      // The thrown value may have a .stack
-      v8::Local<v8::String> stack_trace_string = v8_istr("<no stack trace>");
-      {
-        v8::Local<v8::Value> stack_trace_value;
-        if (try_catch->StackTrace(tostring_context).ToLocal(&stack_trace_value) && stack_trace_value->IsString()) {
-          stack_trace_string = v8::Local<v8::String>::Cast(stack_trace_value);
-        }
+    void success_response(v8::Local<v8::String> retval, uint64_t time)
+    {
+      uint32_t time_ms = (time + 1e6 - 1) / 1e6;
+
+      if (encoding == Encoding::msgpack) {
+        msgpack::Writer writer(thread->response_buffer);
+        writer.string("time");
+        writer.integer(time_ms);
+        write_timings(writer);
+        return;
       }
 
-      return v8_concat({ message_string, v8_istr("\n\nStack trace:\n"), stack_trace_string });
+      // JSON.stringify() gives `undefined` for some values (e.g. functions),
+      // which is not valid JSON.
+      JsonWriter json(thread->response_buffer);
+      json.rewind(response_start);
+      json.raw("{\"status\":\"success\",\"return_value\":");
+      size_t retval_start = json.size();
+      json.json(thread->isolate, retval);
+      if (json.size() - retval_start == 9 && thread->response_buffer.compare(retval_start, 9, "undefined") == 0) {
+        json.rewind(retval_start);
+        json.raw("null");
+      }
+      json.raw(",\"time\":");
+      json.integer(time_ms);
+      write_timings(json);
+      json.raw('}');
     }
 
-    /* v8::String utilities */
+    void script_response(const std::string &id)
+    {
+      if (encoding == Encoding::msgpack) {
+        msgpack::Writer writer(thread->response_buffer);
+        writer.rewind(0);
+        writer.map_header(2);
+        writer.string("status");
+        writer.string("success");
+        writer.string("script_id");
+        writer.string(id.data(), id.size());
+        return;
+      }
 
-    inline v8::Local<v8::String> v8_str(const char* string) {
-      return v8::String::NewFromUtf8(thread->isolate, string, v8::NewStringType::kNormal).ToLocalChecked();
+      JsonWriter json(thread->response_buffer);
+      json.rewind(0);
+      json.raw("{\"status\":\"success\",\"script_id\":");
+      json.string(id.data(), id.size());
+      json.raw('}');
     }
 
-    inline v8::Local<v8::String> v8_istr(const char* string) {
-      return v8::String::NewFromOneByte(thread->isolate, (const uint8_t*)string, v8::NewStringType::kInternalized).ToLocalChecked();
+    void error_response(const char *status, const char *detail)
+    {
+      write_error_response(status, [detail](auto &writer) { writer.string(detail); });
+    }
+
+    // A code_error for the exception caught.
+    void exception_response(v8::Local<v8::Context> tostring_context, v8::TryCatch *try_catch)
+    {
+      write_error_response("code_error", [&](auto &writer) { write_exception_detail(writer, tostring_context, try_catch); });
+    }
+
+    // The detail is written by write_detail(writer), with the writer of the
+    // response's encoding.
+    template <class WriteDetail>
+    void write_error_response(const char *status, WriteDetail &&write_detail)
+    {
+      RequestTimings::Clock::time_point begin = RequestTimings::Clock::now();
+      outcome = strcmp(status, "bad_request") == 0 ? Outcome::bad_request : Outcome::code_error;
+
+      if (encoding == Encoding::msgpack) {
+        msgpack::Writer writer(thread->response_buffer);
+        writer.rewind(response_start);
+        writer.map_header(2);
+        writer.string("status");
+        writer.string(status);
+        writer.string("detail");
+        write_detail(writer);
+      } else {
+        JsonWriter json(thread->response_buffer);
+        json.rewind(response_start);
+        json.raw("{\"status\":");
+        json.string(status);
+        json.raw(",\"detail\":");
+        write_detail(json);
+        json.raw('}');
+      }
+      error_time += std::chrono::duration_cast<std::chrono::nanoseconds>(RequestTimings::Clock::now() - begin).count();
     }
 
-    template <size_t SIZE> v8::Local<v8::String> v8_concat(const v8::Local<v8::String> (&parts)[SIZE])
+    // The exception's message and where it was thrown, then its stack trace,
+    // as a string. Written in pieces, without joining them in V8 first.
+    template <class Writer>
+    void write_exception_detail(Writer &writer, v8::Local<v8::Context> tostring_context, v8::TryCatch *try_catch)
     {
-      v8::Local<v8::String> buf = v8::String::Empty(thread->isolate);
-      for (size_t i = 0; i < SIZE; i++)
-        buf = v8::String::Concat(thread->isolate, buf, parts[i]);
-      return buf;
+      size_t start = writer.begin_string();
+      v8::Local<v8::Message> message = try_catch->Message();
+      if (message.IsEmpty()) {
+        writer.string_piece("<no message>");
+      } else {
+        char line_string[22];
+        writer.string_piece(thread->isolate, message->Get());
+        writer.string_piece(" [");
+        writer.string_piece(thread->isolate, message->GetScriptOrigin().ResourceName()->ToString(tostring_context).ToLocalChecked());
+        writer.string_piece(line_string, snprintf(line_string, sizeof(line_string), ":%d]", message->GetLineNumber(tostring_context).FromMaybe(-1)));
+      }
+
+      // The thrown value may have a .stack
+      writer.string_piece("\n\nStack trace:\n");
+      v8::Local<v8::Value> stack_trace_value;
+      if (try_catch->StackTrace(tostring_context).ToLocal(&stack_trace_value) && stack_trace_value->IsString())
+        writer.string_piece(thread->isolate, v8::Local<v8::String>::Cast(stack_trace_value));
+      else
+        writer.string_piece("<no stack trace>");
+      writer.finish_string(start);
+    }
+
+    /* v8::String utilities */
+
+    inline v8::Local<v8::String> v8_istr(const char* string) {
+      return v8::String::NewFromOneByte(thread->isolate, (const uint8_t*)string, v8::NewStringType::kInternalized).ToLocalChecked();
     }
 };
 
+inline const intptr_t *external_references()
+{
+  static const intptr_t references[] = {
+    reinterpret_cast<intptr_t>(&RequestContext::cputime_getter),
+    0,
+  };
+  return references;
+}
+
+inline OwnedIsolate GlobalContext::create_isolate()
+{
+  v8::ResourceConstraints resource_constraints;
+  resource_constraints.set_max_semi_space_size_in_kb(1024);
+  resource_constraints.set_max_old_space_size(64 + (datasets_heap_size + 1024 * 1024 - 1) / (1024 * 1024));
+
+  v8::Isolate::CreateParams create_params;
+  create_params.constraints = resource_constraints;
+  create_params.array_buffer_allocator = &allocator;
+  create_params.snapshot_blob = &snapshot;
+  create_params.external_references = external_references();
+
+  return OwnedIsolate(v8::Isolate::New(create_params));
+}
+
+inline void ThreadContext::create_user_context(v8::Local<v8::Context> &context, v8::Local<v8::Object> &implicit_context)
+{
+  context = v8::Context::FromSnapshot(isolate, RequestContext::kSnapshotUserContextIndex).ToLocalChecked();
+  implicit_context = context->GetDataFromSnapshotOnce<v8::Object>(RequestContext::kSnapshotImplicitContextIndex).ToLocalChecked();
+}
+
+inline void ThreadContext::take_user_context(v8::Local<v8::Context> &context, v8::Local<v8::Object> &implicit_context)
+{
+  if (ready_contexts.empty())
+    return create_user_context(context, implicit_context);
+  context = ready_contexts.back().context.Get(isolate);
+  implicit_context = ready_contexts.back().implicit_context.Get(isolate);
+  ready_contexts.pop_back();
+}
+
+inline void ThreadContext::idle(std::chrono::milliseconds budget)
+{
+  if (budget.count() == 0)
+    return;
+  v8::Platform *platform = global->platform.get();
+  double deadline = platform->MonotonicallyIncreasingTime() + budget.count() / 1e3;
+
+  v8::HandleScope handle_scope(isolate);
+  while (ready_contexts.size() < kReadyContexts && platform->MonotonicallyIncreasingTime() < deadline) {
+    v8::Local<v8::Context> context;
+    v8::Local<v8::Object> implicit_context;
+    create_user_context(context, implicit_context);
+    ready_contexts.push_back(ReadyContext{v8::Global<v8::Context>(isolate, context), v8::Global<v8::Object>(isolate, implicit_context)});
+  }
+
+  if (platform->MonotonicallyIncreasingTime() < deadline)
+    isolate->IdleNotificationDeadline(deadline);
+}
+
+inline void GlobalContext::create_snapshot(const Options &options)
+{
+  v8::SnapshotCreator creator(external_references());
+  {
+    // The default context is what v8::Context::New() gives.
+    v8::HandleScope handle_scope(creator.GetIsolate());
+    creator.SetDefaultContext(v8::Context::New(creator.GetIsolate()));
+  }
+  RequestContext::add_user_context_to_snapshot(creator);
+
+  // Isolates get room for the datasets on top of the usual heap limit.
+  datasets_heap_size = ThreadContext::add_datasets_to_snapshot(creator, options.datasets);
+
+  snapshot = creator.CreateBlob(v8::SnapshotCreator::FunctionCodeHandling::kClear);
+}
+
 }
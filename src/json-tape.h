@@ -0,0 +1,303 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace eval {
+
+// A structural index of a JSON document, built in a single pass without
+// creating any V8 values: one node per value, in document order, with the
+// children of arrays and objects following their parent (for objects,
+// alternating key and value). Strings point into the document, unless they
+// contain escapes, in which case they point to an unescaped copy. The
+// document must outlive the tape.
+//
+// Parsing is stricter than JSON.parse() in a few corner cases (nesting deeper
+// than kMaxDepth, escaped lone surrogates), callers fall back to JSON.parse()
+// when it fails.
+class JsonTape {
+  public:
+    enum class Type : uint8_t { null, boolean_false, boolean_true, number, string, array, object };
+
+    struct Node {
+      Type type;
+      uint32_t next;   // index of the node after this value and its children
+      uint32_t count;  // arrays: elements, objects: key/value pairs
+      uint32_t length; // strings (unescaped, in bytes) and numbers
+      const char *data;
+    };
+
+    static constexpr int kMaxDepth = 1000;
+
+  private:
+    std::vector<Node> nodes;
+    std::deque<std::string> unescaped;
+    const char *position;
+    const char *end;
+
+    void skip_whitespace()
+    {
+      while (position < end && (*position == ' ' || *position == '\n' || *position == '\r' || *position == '\t'))
+        position++;
+    }
+
+    bool consume(char c)
+    {
+      skip_whitespace();
+      if (position == end || *position != c)
+        return false;
+      position++;
+      return true;
+    }
+
+    bool consume_literal(const char *literal, size_t length)
+    {
+      if (static_cast<size_t>(end - position) < length || memcmp(position, literal, length) != 0)
+        return false;
+      position += length;
+      return true;
+    }
+
+    static int hex_digit(char c)
+    {
+      if (c >= '0' && c <= '9') return c - '0';
+      if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+      if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+      return -1;
+    }
+
+    bool parse_hex4(uint32_t &code_unit)
+    {
+      if (end - position < 4)
+        return false;
+      code_unit = 0;
+      for (int i = 0; i < 4; i++) {
+        int digit = hex_digit(position[i]);
+        if (digit < 0)
+          return false;
+        code_unit = (code_unit << 4) | digit;
+      }
+      position += 4;
+      return true;
+    }
+
+    static void append_utf8(std::string &out, uint32_t c)
+    {
+      if (c < 0x80) {
+        out += static_cast<char>(c);
+      } else if (c < 0x800) {
+        out += static_cast<char>(0xC0 | (c >> 6));
+        out += static_cast<char>(0x80 | (c & 0x3F));
+      } else if (c < 0x10000) {
+        out += static_cast<char>(0xE0 | (c >> 12));
+        out += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (c & 0x3F));
+      } else {
+        out += static_cast<char>(0xF0 | (c >> 18));
+        out += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (c & 0x3F));
+      }
+    }
+
+    // Called with position after the opening quote.
+    bool parse_string(Node &node)
+    {
+      const char *start = position;
+      while (position < end && *position != '"' && *position != '\\') {
+        if (static_cast<unsigned char>(*position) < 0x20)
+          return false;
+        position++;
+      }
+      if (position == end)
+        return false;
+      if (*position == '"') {
+        node.data = start;
+        node.length = position - start;
+        position++;
+        return true;
+      }
+
+      // Has escapes, unescape the whole string.
+      unescaped.emplace_back(start, position - start);
+      std::string &out = unescaped.back();
+      while (true) {
+        if (position == end)
+          return false;
+        char c = *position++;
+        if (c == '"')
+          break;
+        if (static_cast<unsigned char>(c) < 0x20)
+          return false;
+        if (c != '\\') {
+          out += c;
+          continue;
+        }
+        if (position == end)
+          return false;
+        switch (*position++) {
+          case '"': out += '"'; break;
+          case '\\': out += '\\'; break;
+          case '/': out += '/'; break;
+          case 'b': out += '\b'; break;
+          case 'f': out += '\f'; break;
+          case 'n': out += '\n'; break;
+          case 'r': out += '\r'; break;
+          case 't': out += '\t'; break;
+          case 'u': {
+            uint32_t c;
+            if (!parse_hex4(c))
+              return false;
+            if (c >= 0xD800 && c <= 0xDBFF) {
+              uint32_t low;
+              if (!consume_literal("\\u", 2) || !parse_hex4(low) || low < 0xDC00 || low > 0xDFFF)
+                return false;
+              c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+            } else if (c >= 0xDC00 && c <= 0xDFFF) {
+              return false;
+            }
+            append_utf8(out, c);
+            break;
+          }
+          default:
+            return false;
+        }
+      }
+      node.data = out.data();
+      node.length = out.length();
+      return true;
+    }
+
+    bool parse_number(Node &node)
+    {
+      const char *start = position;
+      if (position < end && *position == '-')
+        position++;
+      if (position == end)
+        return false;
+      if (*position == '0') {
+        position++;
+      } else if (*position >= '1' && *position <= '9') {
+        while (position < end && *position >= '0' && *position <= '9') position++;
+      } else {
+        return false;
+      }
+      if (position < end && *position == '.') {
+        position++;
+        if (position == end || *position < '0' || *position > '9')
+          return false;
+        while (position < end && *position >= '0' && *position <= '9') position++;
+      }
+      if (position < end && (*position == 'e' || *position == 'E')) {
+        position++;
+        if (position < end && (*position == '+' || *position == '-'))
+          position++;
+        if (position == end || *position < '0' || *position > '9')
+          return false;
+        while (position < end && *position >= '0' && *position <= '9') position++;
+      }
+      node.data = start;
+      node.length = position - start;
+      return true;
+    }
+
+    bool parse_value(int depth)
+    {
+      skip_whitespace();
+      if (position == end || depth > kMaxDepth || nodes.size() >= UINT32_MAX)
+        return false;
+
+      size_t index = nodes.size();
+      nodes.push_back(Node{Type::null, 0, 0, 0, nullptr});
+      switch (*position) {
+        case 'n':
+          if (!consume_literal("null", 4)) return false;
+          break;
+        case 't':
+          if (!consume_literal("true", 4)) return false;
+          nodes[index].type = Type::boolean_true;
+          break;
+        case 'f':
+          if (!consume_literal("false", 5)) return false;
+          nodes[index].type = Type::boolean_false;
+          break;
+        case '"':
+          position++;
+          nodes[index].type = Type::string;
+          if (!parse_string(nodes[index])) return false;
+          break;
+        case '[': {
+          position++;
+          uint32_t count = 0;
+          if (!consume(']')) {
+            do {
+              if (!parse_value(depth + 1)) return false;
+              count++;
+            } while (consume(','));
+            if (!consume(']')) return false;
+          }
+          nodes[index].type = Type::array;
+          nodes[index].count = count;
+          break;
+        }
+        case '{': {
+          position++;
+          uint32_t count = 0;
+          if (!consume('}')) {
+            do {
+              if (!consume('"')) return false;
+              nodes.push_back(Node{Type::string, static_cast<uint32_t>(nodes.size() + 1), 0, 0, nullptr});
+              if (!parse_string(nodes.back())) return false;
+              if (!consume(':') || !parse_value(depth + 1)) return false;
+              count++;
+            } while (consume(','));
+            if (!consume('}')) return false;
+          }
+          nodes[index].type = Type::object;
+          nodes[index].count = count;
+          break;
+        }
+        default:
+          nodes[index].type = Type::number;
+          if (!parse_number(nodes[index])) return false;
+      }
+      nodes[index].next = nodes.size();
+      return true;
+    }
+
+  public:
+    // Replaces the tape with one for the given document. Returns false if it
+    // is not (supported) JSON, leaving the tape unusable.
+    bool parse(const char *data, size_t length)
+    {
+      nodes.clear();
+      unescaped.clear();
+      position = data;
+      end = data + length;
+      if (!parse_value(0))
+        return false;
+      skip_whitespace();
+      return position == end;
+    }
+
+    const Node &operator[](uint32_t index) const { return nodes[index]; }
+
+    // Finds the value of a key in an object node, the last one if repeated
+    // (like JSON.parse()). Returns 0 (never a value) if missing.
+    uint32_t find(uint32_t object, const char *key, size_t key_length) const
+    {
+      uint32_t found = 0;
+      uint32_t child = object + 1;
+      for (uint32_t i = 0; i < nodes[object].count; i++) {
+        if (nodes[child].length == key_length && memcmp(nodes[child].data, key, key_length) == 0)
+          found = child + 1;
+        child = nodes[child + 1].next;
+      }
+      return found;
+    }
+};
+
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <v8.h>
+
+namespace eval {
+
+// Appends JSON text to a buffer, in UTF-8. Used for the responses' envelope,
+// so that building them runs no JavaScript (no toJSON() or getters that
+// user code could have replaced) and creates nothing on the V8 heap.
+class JsonWriter {
+  private:
+    std::string &buffer;
+
+    static bool needs_escape(char c)
+    {
+      return c == '"' || c == '\\' || static_cast<unsigned char>(c) < 0x20;
+    }
+
+    // Escapes what was appended since the given size, the way
+    // JSON.stringify() does. Most strings need nothing, and are not copied.
+    void escape_from(size_t start)
+    {
+      size_t i = start;
+      while (i < buffer.size() && !needs_escape(buffer[i]))
+        i++;
+      if (i == buffer.size())
+        return;
+
+      std::string rest(buffer, i);
+      buffer.resize(i);
+      for (char c : rest) {
+        if (!needs_escape(c)) {
+          buffer.push_back(c);
+          continue;
+        }
+        buffer.push_back('\\');
+        switch (c) {
+          case '"': buffer.push_back('"'); break;
+          case '\\': buffer.push_back('\\'); break;
+          case '\b': buffer.push_back('b'); break;
+          case '\f': buffer.push_back('f'); break;
+          case '\n': buffer.push_back('n'); break;
+          case '\r': buffer.push_back('r'); break;
+          case '\t': buffer.push_back('t'); break;
+          default: {
+            static const char hex[] = "0123456789abcdef";
+            buffer.append("u00");
+            buffer.push_back(hex[static_cast<unsigned char>(c) >> 4]);
+            buffer.push_back(hex[c & 0xf]);
+          }
+        }
+      }
+    }
+
+  public:
+    JsonWriter(std::string &buffer) : buffer(buffer) {}
+
+    size_t size() const { return buffer.size(); }
+
+    // Drops everything written after the given size.
+    void rewind(size_t size) { buffer.resize(size); }
+
+    // JSON text as is, e.g. punctuation and keys.
+    void raw(char c) { buffer.push_back(c); }
+    void raw(const char *text) { buffer.append(text); }
+    void raw(const char *text, size_t length) { buffer.append(text, length); }
+
+    void integer(uint64_t value) { buffer.append(std::to_string(value)); }
+
+    // With six significant digits, like std::ostream.
+    void number(double value)
+    {
+      char text[32];
+      buffer.append(text, snprintf(text, sizeof(text), "%g", value));
+    }
+
+    void string(const char *value, size_t length)
+    {
+      size_t start = begin_string();
+      string_piece(value, length);
+      finish_string(start);
+    }
+
+    void string(const char *value) { string(value, strlen(value)); }
+    void string(const std::string &value) { string(value.data(), value.size()); }
+
+    // Lone surrogates become U+FFFD.
+    void string(v8::Isolate *isolate, v8::Local<v8::String> value)
+    {
+      size_t start = begin_string();
+      string_piece(isolate, value);
+      finish_string(start);
+    }
+
+    // For strings written in pieces of UTF-8, as they are: begin_string()
+    // opens the string, finish_string() escapes what was appended since and
+    // closes it.
+    size_t begin_string()
+    {
+      buffer.push_back('"');
+      return buffer.size();
+    }
+
+    void string_piece(const char *data, size_t length) { buffer.append(data, length); }
+    void string_piece(const char *data) { buffer.append(data); }
+
+    void string_piece(v8::Isolate *isolate, v8::Local<v8::String> value)
+    {
+      int length = value->Utf8Length(isolate);
+      size_t start = buffer.size();
+      buffer.resize(start + length);
+      value->WriteUtf8(isolate, &buffer[start], length, nullptr, v8::String::NO_NULL_TERMINATION | v8::String::REPLACE_INVALID_UTF8);
+    }
+
+    void finish_string(size_t start)
+    {
+      escape_from(start);
+      buffer.push_back('"');
+    }
+
+    // A value that is JSON text already, as made by JSON.stringify().
+    void json(v8::Isolate *isolate, v8::Local<v8::String> value)
+    {
+      string_piece(isolate, value);
+    }
+};
+
+}
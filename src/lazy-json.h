@@ -0,0 +1,322 @@
+#pragma once
+
+#include <cstdlib>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <v8.h>
+#include "json-tape.h"
+
+namespace eval {
+
+// Exposes a JsonTape to JavaScript, creating V8 values only for the parts
+// that are used. Objects are created empty, with interceptors that turn a
+// member into a real property (with a real V8 value) the first time it is
+// touched in any way: read, tested for, written, deleted, enumerated... After
+// that, interceptors leave it alone, so the object behaves like any other,
+// except that the order of its keys is the order they were first touched in.
+// Arrays are created whole, their objects lazily.
+//
+// One document at a time per isolate; objects from a previous document must
+// no longer be used.
+class LazyJson {
+  private:
+    struct Member {
+      uint32_t value; // node
+      bool consumed;
+    };
+
+    struct ObjectState {
+      LazyJson *owner;
+      uint32_t node;
+      std::unordered_map<std::string_view, Member> members; // built on first use
+      bool indexed = false;
+    };
+
+    v8::Isolate *isolate;
+    v8::Global<v8::ObjectTemplate> object_template;
+    v8::Global<v8::Value> object_prototype; // of the document's context
+    JsonTape tape;
+    std::deque<ObjectState> objects;
+
+    static ObjectState *state_of(v8::Local<v8::Object> holder)
+    {
+      return static_cast<ObjectState *>(holder->GetAlignedPointerFromInternalField(0));
+    }
+
+    void index(ObjectState &state)
+    {
+      if (state.indexed)
+        return;
+      uint32_t child = state.node + 1;
+      for (uint32_t i = 0; i < tape[state.node].count; i++) {
+        const JsonTape::Node &key = tape[child];
+        state.members[std::string_view(key.data, key.length)] = Member{child + 1, false}; // last one wins
+        child = tape[child + 1].next;
+      }
+      state.indexed = true;
+    }
+
+    Member *find(ObjectState &state, const std::string_view &key)
+    {
+      index(state);
+      auto found = state.members.find(key);
+      return found == state.members.end() ? nullptr : &found->second;
+    }
+
+    // Turns the member into a real property of the object, and returns its
+    // value.
+    v8::MaybeLocal<v8::Value> consume(v8::Local<v8::Object> holder, Member &member, v8::Local<v8::Name> name)
+    {
+      member.consumed = true; // first, defining the property calls the interceptors again
+      v8::Local<v8::Context> context = holder->CreationContext();
+      v8::Local<v8::Value> value;
+      if (!materialize(context, member.value).ToLocal(&value) ||
+          !holder->CreateDataProperty(context, name, value).FromMaybe(false))
+        return v8::MaybeLocal<v8::Value>();
+      return value;
+    }
+
+    static bool is_index(const std::string_view &key)
+    {
+      if (key.empty() || key.size() > 10 || (key[0] == '0' && key.size() > 1))
+        return false;
+      uint64_t value = 0;
+      for (char c : key) {
+        if (c < '0' || c > '9')
+          return false;
+        value = value * 10 + (c - '0');
+      }
+      return value < UINT32_MAX;
+    }
+
+    // Consumes all remaining members of one kind, returning their keys.
+    v8::Local<v8::Array> consume_all(v8::Local<v8::Object> holder, bool indices)
+    {
+      ObjectState &state = *state_of(holder);
+      index(state);
+      v8::Local<v8::Context> context = holder->CreationContext();
+      v8::Local<v8::Array> keys = v8::Array::New(isolate);
+      uint32_t count = 0;
+      uint32_t child = state.node + 1;
+      for (uint32_t i = 0; i < tape[state.node].count; i++) {
+        std::string_view key(tape[child].data, tape[child].length);
+        child = tape[child + 1].next;
+        if (is_index(key) != indices)
+          continue;
+        v8::Local<v8::Value> name = indices
+          ? v8::Local<v8::Value>(v8::Integer::NewFromUnsigned(isolate, strtoul(std::string(key).c_str(), nullptr, 10)))
+          : v8::Local<v8::Value>(key_string(key));
+        Member *member = find(state, key);
+        if (member && !member->consumed && !consume(holder, *member, name->ToString(context).ToLocalChecked()).IsEmpty())
+          keys->Set(context, count++, name).ToChecked();
+      }
+      return keys;
+    }
+
+    v8::Local<v8::String> key_string(const std::string_view &key)
+    {
+      return v8::String::NewFromUtf8(isolate, key.data(), v8::NewStringType::kInternalized, key.size()).ToLocalChecked();
+    }
+
+    v8::MaybeLocal<v8::Value> materialize(v8::Local<v8::Context> context, uint32_t index)
+    {
+      const JsonTape::Node &node = tape[index];
+      switch (node.type) {
+        case JsonTape::Type::null:
+          return v8::Null(isolate);
+        case JsonTape::Type::boolean_false:
+          return v8::False(isolate);
+        case JsonTape::Type::boolean_true:
+          return v8::True(isolate);
+        case JsonTape::Type::number:
+          return v8::Number::New(isolate, strtod(std::string(node.data, node.length).c_str(), nullptr));
+        case JsonTape::Type::string: {
+          v8::Local<v8::String> string;
+          if (!v8::String::NewFromUtf8(isolate, node.data, v8::NewStringType::kNormal, node.length).ToLocal(&string))
+            return v8::MaybeLocal<v8::Value>();
+          return string;
+        }
+        case JsonTape::Type::array: {
+          v8::EscapableHandleScope handle_scope(isolate);
+          std::vector<v8::Local<v8::Value>> elements(node.count);
+          uint32_t child = index + 1;
+          for (uint32_t i = 0; i < node.count; i++) {
+            if (!materialize(context, child).ToLocal(&elements[i]))
+              return v8::MaybeLocal<v8::Value>();
+            child = tape[child].next;
+          }
+          return handle_scope.Escape(v8::Array::New(isolate, elements.data(), elements.size()));
+        }
+        case JsonTape::Type::object: {
+          v8::Local<v8::Object> object;
+          // Template instances inherit from a prototype of their own, with
+          // its own constructor; JSON.parse objects, from Object.prototype.
+          if (!object_template.Get(isolate)->NewInstance(context).ToLocal(&object) ||
+              !object->SetPrototype(context, object_prototype.Get(isolate)).FromMaybe(false))
+            return v8::MaybeLocal<v8::Value>();
+          objects.push_back(ObjectState{this, index, {}});
+          object->SetAlignedPointerInInternalField(0, &objects.back());
+          return object;
+        }
+      }
+      return v8::MaybeLocal<v8::Value>();
+    }
+
+    /* Interceptors */
+
+    // Reads, and checks for existence, create the real property and answer
+    // for it, since V8 does not look again after an interceptor declines.
+    // Writes, definitions and deletions only mark the member as consumed and
+    // then let V8 proceed as with any other property. The interceptors come
+    // before the prototype chain, so that members named like properties of
+    // Object.prototype (constructor, toString...) still shadow them; once
+    // consumed, they decline and V8 finds the real property.
+
+    struct Touch {
+      LazyJson *owner;
+      Member *member; // null if consumed already, or not a member
+      bool consumed;  // a member, consumed already
+      v8::Local<v8::Name> name;
+    };
+
+    static Touch touch(v8::Isolate *isolate, v8::Local<v8::Object> holder, const std::string_view &key, v8::Local<v8::Name> name)
+    {
+      ObjectState &state = *state_of(holder);
+      Member *member = state.owner->find(state, key);
+      if (member && member->consumed)
+        return Touch{state.owner, nullptr, true, name};
+      return Touch{state.owner, member, false, name};
+    }
+
+    static Touch touch(v8::Isolate *isolate, v8::Local<v8::Object> holder, v8::Local<v8::Name> name)
+    {
+      v8::String::Utf8Value key(isolate, name);
+      return touch(isolate, holder, std::string_view(*key, key.length()), name);
+    }
+
+    static Touch touch(v8::Isolate *isolate, v8::Local<v8::Object> holder, uint32_t index)
+    {
+      std::string key = std::to_string(index);
+      return touch(isolate, holder, key, v8::String::NewFromUtf8(isolate, key.data(), v8::NewStringType::kNormal, key.size()).ToLocalChecked());
+    }
+
+    template <class Key>
+    static void get(Key key, const v8::PropertyCallbackInfo<v8::Value> &info)
+    {
+      Touch touched = touch(info.GetIsolate(), info.Holder(), key);
+      v8::Local<v8::Value> value;
+      if (touched.member && touched.owner->consume(info.Holder(), *touched.member, touched.name).ToLocal(&value))
+        info.GetReturnValue().Set(value);
+    }
+
+    // Also answers for members turned into real properties, since V8 asks
+    // for the attributes of the keys the enumerators return.
+    template <class Key>
+    static void query(Key key, const v8::PropertyCallbackInfo<v8::Integer> &info)
+    {
+      Touch touched = touch(info.GetIsolate(), info.Holder(), key);
+      if (touched.member && !touched.owner->consume(info.Holder(), *touched.member, touched.name).IsEmpty()) {
+        info.GetReturnValue().Set(v8::Integer::New(info.GetIsolate(), v8::None));
+      } else if (touched.consumed) {
+        v8::Local<v8::Context> context = info.GetIsolate()->GetCurrentContext();
+        v8::PropertyAttribute attributes;
+        if (info.Holder()->HasRealNamedProperty(context, touched.name).FromMaybe(false) &&
+            info.Holder()->GetRealNamedPropertyAttributes(context, touched.name).To(&attributes))
+          info.GetReturnValue().Set(v8::Integer::New(info.GetIsolate(), attributes));
+      }
+    }
+
+    template <class Key>
+    static void descriptor(Key key, const v8::PropertyCallbackInfo<v8::Value> &info)
+    {
+      v8::Isolate *isolate = info.GetIsolate();
+      Touch touched = touch(isolate, info.Holder(), key);
+      v8::Local<v8::Value> value;
+      if (!touched.member || !touched.owner->consume(info.Holder(), *touched.member, touched.name).ToLocal(&value))
+        return;
+      v8::Local<v8::Context> context = isolate->GetCurrentContext();
+      v8::Local<v8::Object> result = v8::Object::New(isolate);
+      result->Set(context, v8::String::NewFromUtf8(isolate, "value", v8::NewStringType::kInternalized).ToLocalChecked(), value).ToChecked();
+      for (const char *attribute : {"writable", "enumerable", "configurable"})
+        result->Set(context, v8::String::NewFromUtf8(isolate, attribute, v8::NewStringType::kInternalized).ToLocalChecked(), v8::True(isolate)).ToChecked();
+      info.GetReturnValue().Set(result);
+    }
+
+    template <class Key, class Info>
+    static void overwrite(Key key, const Info &info)
+    {
+      Touch touched = touch(info.GetIsolate(), info.Holder(), key);
+      if (touched.member)
+        touched.member->consumed = true;
+    }
+
+    template <class Key>
+    static void remove(Key key, const v8::PropertyCallbackInfo<v8::Boolean> &info)
+    {
+      Touch touched = touch(info.GetIsolate(), info.Holder(), key);
+      if (touched.member) {
+        touched.member->consumed = true;
+        info.GetReturnValue().Set(true);
+      }
+    }
+
+  public:
+    LazyJson(v8::Isolate *isolate) :
+        isolate(isolate)
+    {
+      v8::HandleScope handle_scope(isolate);
+      v8::Local<v8::ObjectTemplate> templ = v8::ObjectTemplate::New(isolate);
+      templ->SetInternalFieldCount(1);
+      templ->SetHandler(v8::NamedPropertyHandlerConfiguration(
+        [](v8::Local<v8::Name> name, const v8::PropertyCallbackInfo<v8::Value> &info) { get(name, info); },
+        [](v8::Local<v8::Name> name, v8::Local<v8::Value>, const v8::PropertyCallbackInfo<v8::Value> &info) { overwrite(name, info); },
+        [](v8::Local<v8::Name> name, const v8::PropertyCallbackInfo<v8::Integer> &info) { query(name, info); },
+        [](v8::Local<v8::Name> name, const v8::PropertyCallbackInfo<v8::Boolean> &info) { remove(name, info); },
+        [](const v8::PropertyCallbackInfo<v8::Array> &info) {
+          info.GetReturnValue().Set(state_of(info.Holder())->owner->consume_all(info.Holder(), false));
+        },
+        [](v8::Local<v8::Name> name, const v8::PropertyDescriptor &, const v8::PropertyCallbackInfo<v8::Value> &info) { overwrite(name, info); },
+        [](v8::Local<v8::Name> name, const v8::PropertyCallbackInfo<v8::Value> &info) { descriptor(name, info); },
+        v8::Local<v8::Value>(),
+        v8::PropertyHandlerFlags::kOnlyInterceptStrings));
+      templ->SetHandler(v8::IndexedPropertyHandlerConfiguration(
+        [](uint32_t index, const v8::PropertyCallbackInfo<v8::Value> &info) { get(index, info); },
+        [](uint32_t index, v8::Local<v8::Value>, const v8::PropertyCallbackInfo<v8::Value> &info) { overwrite(index, info); },
+        [](uint32_t index, const v8::PropertyCallbackInfo<v8::Integer> &info) { query(index, info); },
+        [](uint32_t index, const v8::PropertyCallbackInfo<v8::Boolean> &info) { remove(index, info); },
+        [](const v8::PropertyCallbackInfo<v8::Array> &info) {
+          info.GetReturnValue().Set(state_of(info.Holder())->owner->consume_all(info.Holder(), true));
+        },
+        [](uint32_t index, const v8::PropertyDescriptor &, const v8::PropertyCallbackInfo<v8::Value> &info) { overwrite(index, info); },
+        [](uint32_t index, const v8::PropertyCallbackInfo<v8::Value> &info) { descriptor(index, info); },
+        v8::Local<v8::Value>()));
+      object_template.Reset(isolate, templ);
+    }
+
+    // Indexes a new document. Returns false if it is not (supported) JSON.
+    bool parse(const char *data, size_t length)
+    {
+      objects.clear();
+      return tape.parse(data, length);
+    }
+
+    // Whether the document is an object with the key set to true.
+    bool has_true(const char *key)
+    {
+      if (tape[0].type != JsonTape::Type::object)
+        return false;
+      uint32_t value = tape.find(0, key, strlen(key));
+      return value != 0 && tape[value].type == JsonTape::Type::boolean_true;
+    }
+
+    v8::MaybeLocal<v8::Value> root(v8::Local<v8::Context> context)
+    {
+      v8::Context::Scope context_scope(context);
+      object_prototype.Reset(isolate, v8::Object::New(isolate)->GetPrototype());
+      return materialize(context, 0);
+    }
+};
+
+}
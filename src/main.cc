@@ -1,25 +1,385 @@
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <signal.h>
+#include <sstream>
 #include <thread>
+#include <vector>
 #include <boost/program_options.hpp>
 #include <boost/asio.hpp>
+#include "bulk.h"
+#include "dispatcher.h"
 #include "error-handling.h"
 #include "evaluation.h"
 
 namespace po = boost::program_options;
 using boost::asio::ip::tcp;
 
+// Frames larger than this are a protocol violation, not a request.
+constexpr uint32_t kMaxFrameLength = 256 * 1024 * 1024;
+
+// How long to wait before accepting again after accepting failed (e.g. out
+// of file descriptors), instead of failing again right away.
+constexpr std::chrono::milliseconds kAcceptRetryDelay(100);
+
+// How often the trace file is flushed, if any.
+constexpr std::chrono::seconds kTraceFlushInterval(1);
+
+// Lines of a bulk input file a thread takes at a time.
+constexpr size_t kBulkBatchLines = 64;
+
+class Connection;
+
+// A complete request, waiting for a worker.
+struct Job {
+  std::shared_ptr<Connection> connection;
+  std::string request_blob;
+  bool pure;
+};
+
+// A client connection. Requests are read asynchronously on the I/O thread
+// and handed to the dispatcher once complete. Workers hand the response
+// back, and the I/O thread writes it, so that slow readers hold up no
+// worker. Nothing else is read until the response is written, so framed
+// requests are answered in order, one at a time. Dropping the last
+// reference closes the connection.
+class Connection : public std::enable_shared_from_this<Connection> {
+  private:
+    tcp::socket sock;
+    eval::Dispatcher<Job> &dispatcher;
+    bool framed = false;
+    uint32_t frame_length;
+    std::string request_blob;
+    uint32_t response_length; // as the frame's prefix
+    std::string response; // being written
+    std::shared_ptr<const std::string> prepared_response; // instead of the above
+
+    void dispatch()
+    {
+      eval::SchedulingHints hints = eval::SchedulingHints::from_request(request_blob);
+      dispatcher.push(Job{shared_from_this(), std::move(request_blob), hints.pure}, hints);
+    }
+
+    // Reads a one-shot request until the client shuts down its sending side.
+    void read_rest()
+    {
+      auto self = shared_from_this();
+      boost::asio::async_read(sock, boost::asio::dynamic_buffer(request_blob), boost::asio::transfer_all(), [self](const boost::system::error_code &error, size_t) {
+        if (error == boost::asio::error::eof)
+          self->dispatch();
+      });
+    }
+
+    // Reads a length-prefixed frame. Stops if the client is done sending (or
+    // went away), either cleanly between frames or in the middle of one.
+    void read_frame()
+    {
+      auto self = shared_from_this();
+      boost::asio::async_read(sock, boost::asio::buffer(&frame_length, sizeof(frame_length)), [self](const boost::system::error_code &error, size_t) {
+        if (error)
+          return;
+        self->frame_length = ntohl(self->frame_length);
+        if (self->frame_length > kMaxFrameLength)
+          return self->reject_frame();
+        self->request_blob.resize(self->frame_length);
+        boost::asio::async_read(self->sock, boost::asio::buffer(&self->request_blob[0], self->frame_length), [self](const boost::system::error_code &error, size_t) {
+          if (!error)
+            self->dispatch();
+        });
+      });
+    }
+
+    // Writes the response taken by respond(), on the I/O thread.
+    void write_response(std::string &&buffer)
+    {
+      auto self = shared_from_this();
+      auto written = [self, buffer = std::move(buffer)](const boost::system::error_code &error, size_t) mutable {
+        self->finish(error, std::move(buffer));
+      };
+      const std::string &data = prepared_response ? *prepared_response : response;
+      if (!framed)
+        return boost::asio::async_write(sock, boost::asio::buffer(data), std::move(written));
+      std::array<boost::asio::const_buffer, 2> buffers = {
+        boost::asio::buffer(&response_length, sizeof(response_length)),
+        boost::asio::buffer(data),
+      };
+      boost::asio::async_write(sock, buffers, std::move(written));
+    }
+
+    // Once the response is written: goes on with the next frame, unless the
+    // client went away.
+    void finish(const boost::system::error_code &error, std::string &&buffer)
+    {
+      prepared_response.reset();
+      if (!framed || error)
+        return;
+      request_blob.swap(buffer);
+      read_frame();
+    }
+
+    // Answers a frame that is too large to be a request, without reading
+    // it, then closes the connection. The client's encoding is not known
+    // yet, so the answer is JSON.
+    void reject_frame()
+    {
+      static const std::string rejection = []{
+        std::string body = "{\"status\":\"bad_request\",\"detail\":\"Request is too large.\"}";
+        uint32_t length = htonl(body.size());
+        return std::string(reinterpret_cast<const char *>(&length), sizeof(length)) + body;
+      }();
+      auto self = shared_from_this();
+      boost::asio::async_write(sock, boost::asio::buffer(rejection), [self](const boost::system::error_code &error, size_t) {
+        // Close once the client has (or sent something), so that unread
+        // input does not reset the connection before it has read the answer.
+        boost::system::error_code ignored;
+        self->sock.shutdown(tcp::socket::shutdown_send, ignored);
+        auto discard = std::make_shared<std::array<char, 1024>>();
+        self->sock.async_read_some(boost::asio::buffer(*discard), [self, discard](const boost::system::error_code &, size_t) {});
+      });
+    }
+
+  public:
+    Connection(tcp::socket &&sock, eval::Dispatcher<Job> &dispatcher) :
+        sock(std::move(sock)),
+        dispatcher(dispatcher)
+    {
+    }
+
+    // The first byte selects the protocol: a zero byte switches the
+    // connection to framed mode, anything else is already part of a
+    // one-shot request.
+    void start()
+    {
+      auto self = shared_from_this();
+      request_blob.resize(1);
+      boost::asio::async_read(sock, boost::asio::buffer(&request_blob[0], 1), [self](const boost::system::error_code &error, size_t read_bytes) {
+        if (read_bytes == 1 && self->request_blob[0] == '\0') {
+          self->framed = true;
+          self->sock.set_option(tcp::no_delay(true));
+          return self->read_frame();
+        }
+        self->request_blob.resize(read_bytes);
+        if (error == boost::asio::error::eof)
+          return self->dispatch();
+        if (!error)
+          self->read_rest();
+      });
+    }
+
+    // Called on a worker thread once the request is handled: takes the
+    // response and has the I/O thread write it, then go on with the next
+    // frame, reading it into the given buffer. The worker is free at once.
+    void respond(eval::RequestContext &request_eval_context, std::string &&buffer)
+    {
+      eval::RequestTimings::Clock::time_point begin = eval::RequestTimings::Clock::now();
+      prepared_response = request_eval_context.take_response(response);
+      response_length = htonl(prepared_response ? prepared_response->size() : response.size());
+      request_eval_context.responded(begin);
+      auto self = shared_from_this();
+      boost::asio::post(sock.get_executor(), [self, buffer = std::move(buffer)]() mutable {
+        self->write_response(std::move(buffer));
+      });
+    }
+};
+
+// Accepts connections until the I/O loop stops. After an error, waits a
+// little on the retry timer first, so that the loop keeps serving the
+// connections it has.
+static void accept_connections(tcp::acceptor &acceptor, boost::asio::steady_timer &retry_timer, eval::Dispatcher<Job> &dispatcher)
+{
+  acceptor.async_accept([&acceptor, &retry_timer, &dispatcher](const boost::system::error_code &error, tcp::socket sock) {
+    if (!error) {
+      std::make_shared<Connection>(std::move(sock), dispatcher)->start();
+      return accept_connections(acceptor, retry_timer, dispatcher);
+    }
+    retry_timer.expires_after(kAcceptRetryDelay);
+    retry_timer.async_wait([&acceptor, &retry_timer, &dispatcher](const boost::system::error_code &) {
+      accept_connections(acceptor, retry_timer, dispatcher);
+    });
+  });
+}
+
+static std::string stats_json(eval::GlobalContext &global, eval::Dispatcher<Job> &dispatcher)
+{
+  std::stringstream out;
+  out << "{";
+  global.write_stats_json(out);
+  out << ",\"queues\":{";
+  auto class_stats = dispatcher.stats();
+  for (size_t i = 0; i < eval::kLatencyClassCount; i++) {
+    const auto &stats = class_stats[i];
+    out << (i ? "," : "") << "\"" << eval::latency_class_name(static_cast<eval::LatencyClass>(i)) << "\":{"
+        << "\"queued\":" << stats.queued << ",\"dispatched\":" << stats.dispatched << ",\"overdue\":" << stats.overdue
+        << ",\"mean_wait\":" << (stats.dispatched ? stats.total_wait / stats.dispatched : 0) / 1e6
+        << ",\"max_wait\":" << stats.max_wait / 1e6 << "}";
+  }
+  out << "}}\n";
+  return out.str();
+}
+
+// Answers every connection to the stats port with the current metrics, as
+// JSON, right away on the I/O thread, so they can be read even when all
+// workers are busy.
+static void accept_stats_connections(tcp::acceptor &acceptor, boost::asio::steady_timer &retry_timer, eval::GlobalContext &global, eval::Dispatcher<Job> &dispatcher)
+{
+  acceptor.async_accept([&acceptor, &retry_timer, &global, &dispatcher](const boost::system::error_code &error, tcp::socket sock) {
+    if (error) {
+      retry_timer.expires_after(kAcceptRetryDelay);
+      return retry_timer.async_wait([&acceptor, &retry_timer, &global, &dispatcher](const boost::system::error_code &) {
+        accept_stats_connections(acceptor, retry_timer, global, dispatcher);
+      });
+    }
+    auto socket = std::make_shared<tcp::socket>(std::move(sock));
+    auto stats = std::make_shared<std::string>(stats_json(global, dispatcher));
+    boost::asio::async_write(*socket, boost::asio::buffer(*stats), [socket, stats](const boost::system::error_code &error, size_t) {
+      // Close once the client has (or sent something), so that unread
+      // input does not reset the connection before it has read everything.
+      boost::system::error_code ignored;
+      socket->shutdown(tcp::socket::shutdown_send, ignored);
+      auto discard = std::make_shared<std::array<char, 1024>>();
+      socket->async_read_some(boost::asio::buffer(*discard), [socket, discard](const boost::system::error_code &, size_t) {});
+    });
+    accept_stats_connections(acceptor, retry_timer, global, dispatcher);
+  });
+}
+
+// Replaces an isolate that has served long enough, with the spare one, once
+// that is ready.
+static void recycle_if_due(std::unique_ptr<eval::ThreadContext> &thread_eval_context, eval::GlobalContext &global_eval_context, eval::ThreadMetrics &thread_metrics)
+{
+  if (!thread_eval_context->due_for_recycling())
+    return;
+  eval::OwnedIsolate spare_isolate = global_eval_context.take_spare_isolate();
+  if (spare_isolate) {
+    thread_eval_context.reset();
+    thread_eval_context.reset(new eval::ThreadContext(&global_eval_context, &thread_metrics, std::move(spare_isolate)));
+    thread_metrics.isolates_recycled.add(1);
+  }
+}
+
+// Flushes the trace file every kTraceFlushInterval, on the I/O thread.
+static void flush_trace_log(boost::asio::steady_timer &timer, eval::GlobalContext &global)
+{
+  timer.expires_after(kTraceFlushInterval);
+  timer.async_wait([&timer, &global](const boost::system::error_code &) {
+    global.flush_trace_log();
+    flush_trace_log(timer, global);
+  });
+}
+
+// Evaluates every line of the input file as a request, on all threads, and
+// writes the responses to the output file, one per line. Returns the number
+// of requests. If a thread fails (e.g. the output cannot be written), the
+// others stop too, and the first error is raised again here, saying how far
+// the output got.
+static uint64_t run_bulk(eval::GlobalContext &global_eval_context, int num_threads, const std::string &input_path, const std::string &output_path, bool unordered)
+{
+  // A closed output pipe is an error like any other, not a signal.
+  signal(SIGPIPE, SIG_IGN);
+
+  eval::BulkInput input(input_path);
+  eval::BulkOutput output(output_path, !unordered);
+  std::atomic<uint64_t> lines{0};
+  bool memoize = global_eval_context.memoizes();
+  std::mutex error_mutex;
+  std::exception_ptr error;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_threads; i++) {
+    threads.emplace_back([&]{
+      try {
+        eval::ThreadMetrics &thread_metrics = global_eval_context.add_thread_metrics();
+        std::unique_ptr<eval::ThreadContext> thread_eval_context(new eval::ThreadContext(&global_eval_context, &thread_metrics));
+        eval::BulkInput::Batch batch;
+        std::string responses;
+        while (input.next(batch, kBulkBatchLines)) {
+          output.wait_turn(batch.sequence);
+          responses.clear();
+          for (size_t line = 0; line < batch.lines.size(); line++) {
+            recycle_if_due(thread_eval_context, global_eval_context, thread_metrics);
+            eval::RequestContext request_eval_context(thread_eval_context.get());
+            std::string &request_blob = thread_eval_context->next_request_buffer();
+            request_blob.assign(batch.lines[line].data, batch.lines[line].length);
+            request_eval_context.handle_request(request_blob, 0, memoize && eval::SchedulingHints::from_request(request_blob).pure);
+            eval::RequestTimings::Clock::time_point begin = eval::RequestTimings::Clock::now();
+            if (unordered)
+              responses += "{\"line\":" + std::to_string(batch.first_line + line) + ",\"response\":";
+            request_eval_context.write_response([&responses](const char *data, size_t length) {
+              responses.append(data, length);
+            });
+            responses += unordered ? "}\n" : "\n";
+            request_eval_context.responded(begin);
+          }
+          lines += batch.lines.size();
+          output.write(batch.sequence, batch.lines.size(), std::move(responses));
+        }
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error)
+          error = std::current_exception();
+        input.stop();
+        output.abort();
+      }
+    });
+  }
+  for (auto &thread : threads)
+    thread.join();
+  try {
+    if (error)
+      std::rethrow_exception(error);
+    output.flush();
+  } catch (const std::exception &e) {
+    throw_with_trace(std::runtime_error("Stopped after writing " + std::to_string(output.written()) + " responses (of " + std::to_string(lines) + " evaluated): " + e.what()));
+  }
+  return lines;
+}
+
 int main(int argc, char *argv[])
 {
   GlobalErrorHandler eh;
 
   // Process arguments
+  eval::Options options;
+  eval::SchedulingOptions scheduling;
   int port;
+  int stats_port;
   int num_threads;
+  size_t code_cache_mb;
+  size_t registered_scripts_mb;
+  size_t result_cache_mb;
+  unsigned result_cache_ttl_s;
+  unsigned idle_time_ms;
+  size_t recycle_heap_mb;
+  std::string bulk_input;
+  std::string bulk_output;
+  bool bulk_unordered;
+  std::vector<std::string> datasets;
   po::options_description desc("Allowed options");
   desc.add_options()
       ("help", "produce help message")
       ("port", po::value<int>(&port)->default_value(1101), "port to listen on")
+      ("stats-port", po::value<int>(&stats_port)->default_value(0), "port to serve metrics on, as JSON (0 disables)")
       ("threads", po::value<int>(&num_threads)->default_value(std::thread::hardware_concurrency()), "number of threads (defaults to hardware concurrency)")
+      ("reserved-threads", po::value<size_t>(&scheduling.reserved_threads)->default_value(0), "threads kept free of batch requests, for interactive ones")
+      ("short-timeout", po::value<uint32_t>(&scheduling.short_timeout_millis)->default_value(50), "requests with a timeout up to this (in ms) are interactive, unless they set 'priority'")
+      ("max-queue-wait", po::value<uint32_t>(&scheduling.max_queue_wait_millis)->default_value(0), "reject requests not started within this many ms as overloaded (0 for no limit)")
+      ("idle-time", po::value<unsigned>(&idle_time_ms)->default_value(5), "time a thread may spend preparing for the next request (and collecting garbage) after each request, in ms (0 disables)")
+      ("recycle-requests", po::value<uint64_t>(&options.recycle_requests)->default_value(0), "replace a thread's isolate after this many requests (0 for never)")
+      ("recycle-heap-size", po::value<size_t>(&recycle_heap_mb)->default_value(0), "replace a thread's isolate once its heap grows to this many MB (0 for never)")
+      ("code-cache-size", po::value<size_t>(&code_cache_mb)->default_value(32), "memory for compiled code of repeated scripts, in MB (0 disables)")
+      ("code-cache-dir", po::value<std::string>(&options.code_cache_directory), "directory to keep compiled code in across restarts")
+      ("registered-scripts-size", po::value<size_t>(&registered_scripts_mb)->default_value(64), "memory for registered scripts, in MB")
+      ("result-cache-size", po::value<size_t>(&result_cache_mb)->default_value(16), "memory for responses of pure requests, in MB (0 disables)")
+      ("result-cache-ttl", po::value<unsigned>(&result_cache_ttl_s)->default_value(60), "how long responses of pure requests are reused, in seconds")
+      ("trace-file", po::value<std::string>(&options.trace_file), "file to write a sample of requests' phases to, in Chrome trace event format")
+      ("trace-sample", po::value<uint64_t>(&options.trace_sample)->default_value(100), "with --trace-file, trace every Nth request of each thread")
+      ("profile-sample", po::value<uint64_t>(&options.profile_sample)->default_value(0), "profile every Nth request of each thread, for a report of the most expensive scripts on the stats port (0 disables)")
+      ("bulk-input", po::value<std::string>(&bulk_input), "instead of serving, evaluate every line of this file as a request, and exit")
+      ("bulk-output", po::value<std::string>(&bulk_output)->default_value("-"), "with --bulk-input, file to write the responses to, one per line, in input order")
+      ("bulk-unordered", po::bool_switch(&bulk_unordered), "with --bulk-input, write responses as they are ready, as {\"line\": <n>, \"response\": <response>}")
+      ("dataset", po::value<std::vector<std::string>>(&datasets), "name=file.json, a read-only dataset all requests see as a variable (repeatable)")
   ;
   po::variables_map vm;
   po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -29,57 +389,100 @@ int main(int argc, char *argv[])
       return 1;
   }
 
+  if (scheduling.reserved_threads >= static_cast<size_t>(num_threads)) {
+    std::cerr << "--reserved-threads must be less than --threads\n";
+    return 1;
+  }
+
   // Prepare global evaluation context
-  eval::GlobalContext global_eval_context;
+  options.code_cache_size = code_cache_mb * 1024 * 1024;
+  options.registered_scripts_size = registered_scripts_mb * 1024 * 1024;
+  options.result_cache_size = result_cache_mb * 1024 * 1024;
+  options.result_cache_ttl = std::chrono::seconds(result_cache_ttl_s);
+  options.recycle_heap_size = recycle_heap_mb * 1024 * 1024;
+  for (const std::string &dataset : datasets) {
+    size_t separator = dataset.find('=');
+    if (separator == std::string::npos || separator == 0) {
+      std::cerr << "Invalid --dataset '" << dataset << "', expected name=file.json\n";
+      return 1;
+    }
+    options.datasets.push_back({dataset.substr(0, separator), dataset.substr(separator + 1)});
+  }
+  eval::GlobalContext global_eval_context(options);
 
-  // Start threads
+  if (!bulk_input.empty()) {
+    auto start = std::chrono::steady_clock::now();
+    uint64_t lines;
+    try {
+      lines = run_bulk(global_eval_context, num_threads, bulk_input, bulk_output, bulk_unordered);
+    } catch (const std::exception &e) {
+      std::cerr << e.what() << "\n";
+      return 1;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << "Evaluated " << lines << " requests in " << seconds << " s (" << lines / seconds << "/s).\n";
+    return 0;
+  }
+
+  // Start worker threads, each with an isolate. They take requests from the
+  // dispatcher as soon as they are free.
+  eval::Dispatcher<Job> dispatcher(num_threads, scheduling);
   std::thread threads[num_threads];
   for (int i = 0; i < num_threads; i++) {
-    threads[i] = std::thread([port]{
-      // Listen for TCP connections.
-      boost::asio::io_service io_service;
-      tcp::acceptor acceptor(io_service);
-      acceptor.open(tcp::v4());
-      acceptor.set_option(boost::asio::socket_base::reuse_address(true));
-      acceptor.set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
-      acceptor.bind(tcp::endpoint(tcp::v4(), port));
-      acceptor.listen();
-
+    threads[i] = std::thread([&global_eval_context, &dispatcher, idle_time_ms]{
       // Prepare thread-level evaluation context
-      eval::ThreadContext thread_eval_context;
+      eval::ThreadMetrics &thread_metrics = global_eval_context.add_thread_metrics();
+      std::unique_ptr<eval::ThreadContext> thread_eval_context(new eval::ThreadContext(&global_eval_context, &thread_metrics));
       while (true)
       {
-        // Prepare request-specific evaluation context
-        eval::RequestContext request_eval_context(&thread_eval_context);
-
-        // Accept a connection
-        tcp::socket sock(io_service);
-        acceptor.accept(sock);
-
-        // Read the request
-        boost::system::error_code error;
-        std::string *request_blob = new std::string();
-        std::size_t read_bytes = boost::asio::read(sock, boost::asio::dynamic_buffer(*request_blob), boost::asio::transfer_all(), error);
-        if (error != boost::asio::error::eof)
-          throw_with_trace(boost::system::system_error(error));
-        assert(request_blob->length() == read_bytes);
-
-        // Evaluate
-        char *response_blob;
-        size_t response_blob_length;
-        request_eval_context.handle_request(request_blob->c_str(), response_blob, response_blob_length);
-        delete request_blob; // no longer needed now
-
-        // Send response
-        std::size_t written_bytes = boost::asio::write(sock, boost::asio::buffer(response_blob, response_blob_length));
-        assert(written_bytes == response_blob_length);
-        sock.close();
+        recycle_if_due(thread_eval_context, global_eval_context, thread_metrics);
+
+        // Unless a request is already waiting, prepare for the next ones.
+        if (!dispatcher.work_available())
+          thread_eval_context->idle(std::chrono::milliseconds(idle_time_ms));
 
+        // Prepare request-specific evaluation context while waiting for a
+        // request.
+        eval::RequestContext request_eval_context(thread_eval_context.get());
+        eval::Dispatcher<Job>::Dispatch dispatch;
+        Job job = dispatcher.pop(dispatch);
+        thread_metrics.queue_wait.record(dispatch.wait);
+
+        std::string &request_blob = thread_eval_context->next_request_buffer();
+        request_blob.swap(job.request_blob);
+        if (dispatch.overdue)
+          request_eval_context.handle_overdue_request(request_blob, dispatch.wait);
+        else
+          request_eval_context.handle_request(request_blob, dispatch.wait, job.pure);
+        job.connection->respond(request_eval_context, std::move(job.request_blob));
+        dispatcher.done(dispatch);
       } // run loop
-      acceptor.close();
     }); // thread
   }
+
+  // Accept connections and read requests on this thread.
+  boost::asio::io_service io_service;
+  tcp::acceptor acceptor(io_service);
+  acceptor.open(tcp::v4());
+  acceptor.set_option(boost::asio::socket_base::reuse_address(true));
+  acceptor.bind(tcp::endpoint(tcp::v4(), port));
+  acceptor.listen();
+  boost::asio::steady_timer accept_retry_timer(io_service);
+  accept_connections(acceptor, accept_retry_timer, dispatcher);
+  tcp::acceptor stats_acceptor(io_service);
+  boost::asio::steady_timer stats_accept_retry_timer(io_service);
+  if (stats_port != 0) {
+    stats_acceptor.open(tcp::v4());
+    stats_acceptor.set_option(boost::asio::socket_base::reuse_address(true));
+    stats_acceptor.bind(tcp::endpoint(tcp::v4(), stats_port));
+    stats_acceptor.listen();
+    accept_stats_connections(stats_acceptor, stats_accept_retry_timer, global_eval_context, dispatcher);
+  }
+  boost::asio::steady_timer trace_flush_timer(io_service);
+  if (global_eval_context.traces())
+    flush_trace_log(trace_flush_timer, global_eval_context);
   std::cout << "eval-the-evil listening on port " << port << ".\n";
+  io_service.run();
 
   // Wait for threads to exit
   for (auto &thread : threads) {
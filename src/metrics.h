@@ -0,0 +1,218 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+namespace eval {
+
+// A number only ever changed by one thread, and read by others. Changing it
+// is a plain load and store, not a read-modify-write, so the thread never
+// waits for anyone.
+class Counter {
+  private:
+    std::atomic<uint64_t> value{0};
+
+  public:
+    void add(uint64_t amount) { value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed); }
+    void set(uint64_t amount) { value.store(amount, std::memory_order_relaxed); }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+// Durations (in ns), counted in buckets that are an eighth of a power of two
+// wide, in the style of HDR histograms: percentiles are within 12.5% of the
+// real value, at any magnitude. Recorded into by one thread only.
+class Histogram {
+  private:
+    static constexpr int kSubBucketBits = 3;
+    static constexpr uint64_t kSubBuckets = 1 << kSubBucketBits;
+    static constexpr size_t kBuckets = (64 - kSubBucketBits + 1) * kSubBuckets;
+
+    std::array<Counter, kBuckets> buckets;
+    Counter sum;
+    Counter max;
+
+    static size_t bucket(uint64_t value)
+    {
+      if (value < kSubBuckets)
+        return value;
+      int exponent = 63 - __builtin_clzll(value);
+      return (exponent - kSubBucketBits + 1) * kSubBuckets + ((value >> (exponent - kSubBucketBits)) & (kSubBuckets - 1));
+    }
+
+    // The largest value counted in a bucket.
+    static uint64_t bucket_max(size_t index)
+    {
+      if (index < kSubBuckets)
+        return index;
+      int exponent = index / kSubBuckets + kSubBucketBits - 1;
+      uint64_t low = (kSubBuckets | (index & (kSubBuckets - 1))) << (exponent - kSubBucketBits);
+      return low + (uint64_t(1) << (exponent - kSubBucketBits)) - 1;
+    }
+
+  public:
+    // Histograms of several threads, added up.
+    class Sum {
+      private:
+        std::array<uint64_t, kBuckets> buckets = {};
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        uint64_t max = 0;
+
+      public:
+        uint64_t total_count() const { return count; }
+        double mean() const { return count ? double(sum) / count : 0; }
+
+        // The value the given fraction of recorded values is at or below,
+        // within a bucket's width (1 for the largest).
+        uint64_t percentile(double fraction) const
+        {
+          uint64_t rank = fraction * count;
+          uint64_t seen = 0;
+          for (size_t i = 0; i < kBuckets; i++) {
+            seen += buckets[i];
+            if (seen > rank)
+              return std::min(bucket_max(i), max);
+          }
+          return max;
+        }
+
+        void add(const Histogram &histogram)
+        {
+          for (size_t i = 0; i < kBuckets; i++) {
+            uint64_t bucket_count = histogram.buckets[i].get();
+            buckets[i] += bucket_count;
+            count += bucket_count;
+          }
+          sum += histogram.sum.get();
+          max = std::max(max, histogram.max.get());
+        }
+
+        // As a JSON object, in ms.
+        void write_json(std::ostream &out) const
+        {
+          out << "{\"count\":" << count
+              << ",\"mean\":" << mean() / 1e6
+              << ",\"p50\":" << percentile(0.5) / 1e6
+              << ",\"p90\":" << percentile(0.9) / 1e6
+              << ",\"p99\":" << percentile(0.99) / 1e6
+              << ",\"p999\":" << percentile(0.999) / 1e6
+              << ",\"max\":" << max / 1e6 << "}";
+        }
+    };
+
+    void record(uint64_t value)
+    {
+      buckets[bucket(value)].add(1);
+      sum.add(value);
+      if (value > max.get())
+        max.set(value);
+    }
+};
+
+// What happened to a request, as counted in metrics.
+enum class Outcome { success, bad_request, code_error, overloaded, memoized };
+constexpr size_t kOutcomeCount = 5;
+
+inline const char *outcome_name(Outcome outcome)
+{
+  static const char *const names[kOutcomeCount] = {"success", "bad_request", "code_error", "overloaded", "memoized"};
+  return names[static_cast<size_t>(outcome)];
+}
+
+// Everything one worker thread counts, across the isolates it goes through.
+struct ThreadMetrics {
+  std::array<Counter, kOutcomeCount> requests;
+  Counter cpu_limit_exceeded; // scripts terminated by the watchdog
+  Counter memory_limit_exceeded;
+  Counter isolates_recycled;
+
+  Histogram queue_wait;
+  Histogram compile;
+  Histogram run; // CPU time of the code, without GC
+  Histogram serialize; // CPU time of the return value
+  Histogram gc; // during a run
+
+  // The current isolate's heap, as of the last request.
+  Counter used_heap_size;
+  Counter total_heap_size;
+  Counter heap_size_limit;
+  Counter external_memory;
+
+  void count(Outcome outcome) { requests[static_cast<size_t>(outcome)].add(1); }
+};
+
+// The metrics of all worker threads, kept apart so that recording never
+// contends, and added up when read.
+class Metrics {
+  private:
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadMetrics>> threads;
+
+  public:
+    // For a new worker thread, lives as long as this.
+    ThreadMetrics &add_thread()
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      threads.emplace_back(new ThreadMetrics());
+      return *threads.back();
+    }
+
+    void write_json(std::ostream &out)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+
+      out << "\"requests\":{";
+      for (size_t i = 0; i < kOutcomeCount; i++) {
+        uint64_t total = 0;
+        for (auto &thread : threads)
+          total += thread->requests[i].get();
+        out << (i ? "," : "") << "\"" << outcome_name(static_cast<Outcome>(i)) << "\":" << total;
+      }
+      out << "}";
+
+      uint64_t cpu_limit_exceeded = 0, memory_limit_exceeded = 0, isolates_recycled = 0;
+      Histogram::Sum queue_wait, compile, run, serialize, gc;
+      for (auto &thread : threads) {
+        cpu_limit_exceeded += thread->cpu_limit_exceeded.get();
+        memory_limit_exceeded += thread->memory_limit_exceeded.get();
+        isolates_recycled += thread->isolates_recycled.get();
+        queue_wait.add(thread->queue_wait);
+        compile.add(thread->compile);
+        run.add(thread->run);
+        serialize.add(thread->serialize);
+        gc.add(thread->gc);
+      }
+      out << ",\"cpu_limit_exceeded\":" << cpu_limit_exceeded
+          << ",\"memory_limit_exceeded\":" << memory_limit_exceeded
+          << ",\"isolates_recycled\":" << isolates_recycled;
+
+      out << ",\"times\":{\"queue_wait\":";
+      queue_wait.write_json(out);
+      out << ",\"compile\":";
+      compile.write_json(out);
+      out << ",\"run\":";
+      run.write_json(out);
+      out << ",\"serialize\":";
+      serialize.write_json(out);
+      out << ",\"gc\":";
+      gc.write_json(out);
+      out << "}";
+
+      out << ",\"threads\":[";
+      for (size_t i = 0; i < threads.size(); i++) {
+        const ThreadMetrics &thread = *threads[i];
+        out << (i ? "," : "") << "{\"used_heap_size\":" << thread.used_heap_size.get()
+            << ",\"total_heap_size\":" << thread.total_heap_size.get()
+            << ",\"heap_size_limit\":" << thread.heap_size_limit.get()
+            << ",\"external_memory\":" << thread.external_memory.get() << "}";
+      }
+      out << "]";
+    }
+};
+
+}
@@ -0,0 +1,654 @@
+#pragma once
+
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <v8.h>
+
+// MessagePack (https://msgpack.org) support, converting directly between the
+// wire format and V8 values, without going through JSON text.
+
+namespace eval {
+namespace msgpack {
+
+// Deeper nesting is rejected, both when decoding and encoding.
+constexpr int kMaxDepth = 1000;
+
+// A request is MessagePack if its first byte cannot start a JSON text.
+inline bool is_msgpack(const std::string &blob)
+{
+  return !blob.empty() && (static_cast<uint8_t>(blob[0]) & 0x80);
+}
+
+// Appends MessagePack values to a buffer.
+class Writer {
+  private:
+    std::string &buffer;
+
+    void put_be(uint64_t value, int bytes)
+    {
+      for (int i = bytes - 1; i >= 0; i--)
+        buffer.push_back(static_cast<char>(value >> (8 * i)));
+    }
+
+    void put_header(uint32_t length, uint8_t fix_tag, uint32_t fix_max, uint8_t tag8, uint8_t tag16, uint8_t tag32)
+    {
+      if (length <= fix_max) {
+        buffer.push_back(fix_tag | length);
+      } else if (tag8 && length <= 0xFF) {
+        buffer.push_back(tag8);
+        put_be(length, 1);
+      } else if (length <= 0xFFFF) {
+        buffer.push_back(tag16);
+        put_be(length, 2);
+      } else {
+        buffer.push_back(tag32);
+        put_be(length, 4);
+      }
+    }
+
+  public:
+    Writer(std::string &buffer) : buffer(buffer) {}
+
+    size_t size() const { return buffer.size(); }
+
+    // Drops everything written after the given size.
+    void rewind(size_t size) { buffer.resize(size); }
+
+    void nil() { buffer.push_back(0xc0); }
+    void boolean(bool value) { buffer.push_back(value ? 0xc3 : 0xc2); }
+
+    void integer(int64_t value)
+    {
+      if (value >= 0) {
+        if (value <= 0x7F)             { buffer.push_back(value); }
+        else if (value <= 0xFF)        { buffer.push_back(0xcc); put_be(value, 1); }
+        else if (value <= 0xFFFF)      { buffer.push_back(0xcd); put_be(value, 2); }
+        else if (value <= 0xFFFFFFFFl) { buffer.push_back(0xce); put_be(value, 4); }
+        else                           { buffer.push_back(0xcf); put_be(value, 8); }
+      } else {
+        if (value >= -32)              { buffer.push_back(value); }
+        else if (value >= INT8_MIN)    { buffer.push_back(0xd0); put_be(value, 1); }
+        else if (value >= INT16_MIN)   { buffer.push_back(0xd1); put_be(value, 2); }
+        else if (value >= INT32_MIN)   { buffer.push_back(0xd2); put_be(value, 4); }
+        else                           { buffer.push_back(0xd3); put_be(value, 8); }
+      }
+    }
+
+    // Integral numbers are written as integers, the rest as float 64.
+    void number(double value)
+    {
+      if (value == 0) {
+        integer(0); // also -0, like JSON
+      } else if (std::trunc(value) == value && value >= -9223372036854775808.0 && value < 9223372036854775808.0) {
+        integer(static_cast<int64_t>(value));
+      } else {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        buffer.push_back(0xcb);
+        put_be(bits, 8);
+      }
+    }
+
+    void string(const char *data, size_t length)
+    {
+      put_header(length, 0xa0, 31, 0xd9, 0xda, 0xdb);
+      buffer.append(data, length);
+    }
+
+    void string(const char *data) { string(data, strlen(data)); }
+
+    void string(v8::Isolate *isolate, v8::Local<v8::String> value)
+    {
+      put_header(value->Utf8Length(isolate), 0xa0, 31, 0xd9, 0xda, 0xdb);
+      string_piece(isolate, value);
+    }
+
+    // For strings written in pieces: begin_string() reserves the largest
+    // header, finish_string() shrinks it to fit what was appended.
+    size_t begin_string() { return reserve_header(); }
+    void string_piece(const char *data, size_t length) { buffer.append(data, length); }
+    void string_piece(const char *data) { buffer.append(data); }
+
+    void string_piece(v8::Isolate *isolate, v8::Local<v8::String> value)
+    {
+      int length = value->Utf8Length(isolate);
+      size_t start = buffer.size();
+      buffer.resize(start + length);
+      value->WriteUtf8(isolate, &buffer[start], length, nullptr, v8::String::NO_NULL_TERMINATION | v8::String::REPLACE_INVALID_UTF8);
+    }
+
+    void finish_string(size_t position) { finish_header(position, buffer.size() - position - 5, 0xa0, 31, 0xd9, 0xda, 0xdb); }
+
+    void array_header(uint32_t length) { put_header(length, 0x90, 15, 0, 0xdc, 0xdd); }
+    void map_header(uint32_t length) { put_header(length, 0x80, 15, 0, 0xde, 0xdf); }
+
+    // For containers whose length is only known after writing their
+    // elements: reserve the largest header and shrink it in finish_*().
+    size_t reserve_header()
+    {
+      size_t position = buffer.size();
+      buffer.append(5, '\0');
+      return position;
+    }
+
+    void finish_map_header(size_t position, uint32_t length) { finish_header(position, length, 0x80, 15, 0, 0xde, 0xdf); }
+
+  private:
+    void finish_header(size_t position, uint32_t length, uint8_t fix_tag, uint32_t fix_max, uint8_t tag8, uint8_t tag16, uint8_t tag32)
+    {
+      std::string header;
+      Writer(header).put_header(length, fix_tag, fix_max, tag8, tag16, tag32);
+      memcpy(&buffer[position], header.data(), header.size());
+      if (header.size() < 5)
+        buffer.erase(position + header.size(), 5 - header.size());
+    }
+};
+
+// Decodes a MessagePack document into V8 values. Maps become plain objects
+// and arrays become arrays, as JSON.parse() would create them.
+class Decoder {
+  private:
+    v8::Isolate *isolate;
+    v8::Local<v8::Context> context;
+    const uint8_t *position;
+    const uint8_t *end;
+
+  public:
+    // Set when decode() fails.
+    const char *error = nullptr;
+
+    Decoder(v8::Local<v8::Context> context, const std::string &blob) :
+        isolate(context->GetIsolate()),
+        context(context),
+        position(reinterpret_cast<const uint8_t *>(blob.data())),
+        end(reinterpret_cast<const uint8_t *>(blob.data()) + blob.size())
+    {
+    }
+
+    // Decodes the whole document, which must be a single value.
+    bool decode(v8::Local<v8::Value> &value)
+    {
+      if (!decode_value(value, 0))
+        return false;
+      if (position != end)
+        return fail("Request is not valid MessagePack (trailing data).");
+      return true;
+    }
+
+  private:
+    bool fail(const char *message)
+    {
+      if (error == nullptr)
+        error = message;
+      return false;
+    }
+
+    bool take(size_t bytes, const uint8_t *&data)
+    {
+      if (static_cast<size_t>(end - position) < bytes)
+        return fail("Request is not valid MessagePack (truncated).");
+      data = position;
+      position += bytes;
+      return true;
+    }
+
+    bool take_be(int bytes, uint64_t &value)
+    {
+      const uint8_t *data;
+      if (!take(bytes, data))
+        return false;
+      value = 0;
+      for (int i = 0; i < bytes; i++)
+        value = (value << 8) | data[i];
+      return true;
+    }
+
+    bool decode_string(size_t length, v8::NewStringType type, v8::Local<v8::String> &string)
+    {
+      const uint8_t *data;
+      if (!take(length, data))
+        return false;
+      if (length > static_cast<size_t>(v8::String::kMaxLength) ||
+          !v8::String::NewFromUtf8(isolate, reinterpret_cast<const char *>(data), type, length).ToLocal(&string))
+        return fail("Request contains a string that is too long.");
+      return true;
+    }
+
+    bool decode_array(size_t length, v8::Local<v8::Value> &value, int depth)
+    {
+      if (length > static_cast<size_t>(end - position))
+        return fail("Request is not valid MessagePack (truncated).");
+      std::vector<v8::Local<v8::Value>> elements(length);
+      for (size_t i = 0; i < length; i++) {
+        if (!decode_value(elements[i], depth + 1))
+          return false;
+      }
+      value = v8::Array::New(isolate, elements.data(), length);
+      return true;
+    }
+
+    bool decode_map(size_t length, v8::Local<v8::Value> &value, int depth)
+    {
+      if (length > static_cast<size_t>(end - position))
+        return fail("Request is not valid MessagePack (truncated).");
+      v8::Local<v8::Object> object = v8::Object::New(isolate);
+      for (size_t i = 0; i < length; i++) {
+        uint64_t key_length;
+        if (!decode_string_length(key_length))
+          return false;
+        v8::Local<v8::String> key;
+        if (!decode_string(key_length, v8::NewStringType::kInternalized, key))
+          return false;
+        v8::Local<v8::Value> element;
+        if (!decode_value(element, depth + 1))
+          return false;
+        if (object->CreateDataProperty(context, key, element).IsNothing())
+          return fail("Request could not be converted.");
+      }
+      value = object;
+      return true;
+    }
+
+    bool decode_string_length(uint64_t &length)
+    {
+      const uint8_t *tag;
+      if (!take(1, tag))
+        return false;
+      if ((*tag & 0xe0) == 0xa0) {
+        length = *tag & 0x1f;
+        return true;
+      }
+      switch (*tag) {
+        case 0xd9: return take_be(1, length);
+        case 0xda: return take_be(2, length);
+        case 0xdb: return take_be(4, length);
+        default: return fail("Request contains a MessagePack map key that is not a string.");
+      }
+    }
+
+    bool decode_value(v8::Local<v8::Value> &value, int depth)
+    {
+      if (depth > kMaxDepth)
+        return fail("Request is nested too deeply.");
+
+      const uint8_t *tag;
+      if (!take(1, tag))
+        return false;
+
+      uint64_t bits;
+      v8::Local<v8::String> string;
+      uint8_t t = *tag;
+      if (t <= 0x7f) {
+        value = v8::Integer::New(isolate, t);
+        return true;
+      } else if (t >= 0xe0) {
+        value = v8::Integer::New(isolate, static_cast<int8_t>(t));
+        return true;
+      } else if ((t & 0xf0) == 0x80) {
+        return decode_map(t & 0x0f, value, depth);
+      } else if ((t & 0xf0) == 0x90) {
+        return decode_array(t & 0x0f, value, depth);
+      } else if ((t & 0xe0) == 0xa0) {
+        if (!decode_string(t & 0x1f, v8::NewStringType::kNormal, string))
+          return false;
+        value = string;
+        return true;
+      }
+
+      switch (t) {
+        case 0xc0: value = v8::Null(isolate); return true;
+        case 0xc2: value = v8::False(isolate); return true;
+        case 0xc3: value = v8::True(isolate); return true;
+
+        case 0xcc: case 0xcd: case 0xce: case 0xcf:
+          if (!take_be(1 << (t - 0xcc), bits))
+            return false;
+          value = v8::Number::New(isolate, static_cast<double>(bits));
+          return true;
+
+        case 0xd0: case 0xd1: case 0xd2: case 0xd3: {
+          int bytes = 1 << (t - 0xd0);
+          if (!take_be(bytes, bits))
+            return false;
+          int64_t signed_bits = bytes == 8 ? static_cast<int64_t>(bits) : static_cast<int64_t>(bits << (64 - 8 * bytes)) >> (64 - 8 * bytes);
+          value = v8::Number::New(isolate, static_cast<double>(signed_bits));
+          return true;
+        }
+
+        case 0xca: {
+          if (!take_be(4, bits))
+            return false;
+          uint32_t bits32 = bits;
+          float number;
+          memcpy(&number, &bits32, sizeof(number));
+          value = v8::Number::New(isolate, number);
+          return true;
+        }
+
+        case 0xcb: {
+          if (!take_be(8, bits))
+            return false;
+          double number;
+          memcpy(&number, &bits, sizeof(number));
+          value = v8::Number::New(isolate, number);
+          return true;
+        }
+
+        case 0xd9: case 0xda: case 0xdb:
+          if (!take_be(1 << (t - 0xd9), bits) || !decode_string(bits, v8::NewStringType::kNormal, string))
+            return false;
+          value = string;
+          return true;
+
+        case 0xdc: case 0xdd:
+          if (!take_be(t == 0xdc ? 2 : 4, bits))
+            return false;
+          return decode_array(bits, value, depth);
+
+        case 0xde: case 0xdf:
+          if (!take_be(t == 0xde ? 2 : 4, bits))
+            return false;
+          return decode_map(bits, value, depth);
+
+        case 0xc4: case 0xc5: case 0xc6:
+          return fail("Request contains MessagePack binary data, which is not supported.");
+
+        default:
+          return fail("Request contains a MessagePack extension type, which is not supported.");
+      }
+    }
+};
+
+// Walks a MessagePack document without decoding it, to look at a request
+// before (or instead of) creating V8 values for it. Only checks structure,
+// what it accepts may still fail to decode.
+class Scanner {
+  private:
+    const uint8_t *position;
+    const uint8_t *end;
+
+    bool take(size_t bytes, const uint8_t *&data)
+    {
+      if (static_cast<size_t>(end - position) < bytes)
+        return false;
+      data = position;
+      position += bytes;
+      return true;
+    }
+
+    bool take_be(int bytes, uint64_t &value)
+    {
+      const uint8_t *data;
+      if (!take(bytes, data))
+        return false;
+      value = 0;
+      for (int i = 0; i < bytes; i++)
+        value = (value << 8) | data[i];
+      return true;
+    }
+
+    bool skip(uint64_t bytes)
+    {
+      const uint8_t *data;
+      return bytes <= static_cast<uint64_t>(end - position) && take(bytes, data);
+    }
+
+    bool skip_values(uint64_t count, int depth)
+    {
+      if (count > static_cast<uint64_t>(end - position))
+        return false;
+      for (uint64_t i = 0; i < count; i++) {
+        if (!skip_value(depth + 1))
+          return false;
+      }
+      return true;
+    }
+
+    bool skip_value(int depth)
+    {
+      const uint8_t *tag;
+      if (depth > kMaxDepth || !take(1, tag))
+        return false;
+
+      uint64_t length;
+      uint8_t t = *tag;
+      if (t <= 0x7f || t >= 0xe0)
+        return true;
+      if ((t & 0xf0) == 0x80)
+        return skip_values(2 * (t & 0x0f), depth);
+      if ((t & 0xf0) == 0x90)
+        return skip_values(t & 0x0f, depth);
+      if ((t & 0xe0) == 0xa0)
+        return skip(t & 0x1f);
+
+      switch (t) {
+        case 0xc0: case 0xc2: case 0xc3:
+          return true;
+        case 0xc4: case 0xc5: case 0xc6:
+          return take_be(1 << (t - 0xc4), length) && skip(length);
+        case 0xc7: case 0xc8: case 0xc9:
+          return take_be(1 << (t - 0xc7), length) && skip(length + 1);
+        case 0xca: return skip(4);
+        case 0xcb: return skip(8);
+        case 0xcc: case 0xcd: case 0xce: case 0xcf:
+          return skip(1 << (t - 0xcc));
+        case 0xd0: case 0xd1: case 0xd2: case 0xd3:
+          return skip(1 << (t - 0xd0));
+        case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8:
+          return skip(1 + (1 << (t - 0xd4)));
+        case 0xd9: case 0xda: case 0xdb:
+          return take_be(1 << (t - 0xd9), length) && skip(length);
+        case 0xdc: case 0xdd:
+          return take_be(t == 0xdc ? 2 : 4, length) && skip_values(length, depth);
+        case 0xde: case 0xdf:
+          return take_be(t == 0xde ? 2 : 4, length) && skip_values(2 * length, depth);
+        default:
+          return false;
+      }
+    }
+
+  public:
+    Scanner(const std::string &blob) :
+        position(reinterpret_cast<const uint8_t *>(blob.data())),
+        end(reinterpret_cast<const uint8_t *>(blob.data()) + blob.size())
+    {
+    }
+
+    bool map_header(uint64_t &length)
+    {
+      const uint8_t *tag;
+      if (!take(1, tag))
+        return false;
+      if ((*tag & 0xf0) == 0x80) {
+        length = *tag & 0x0f;
+        return true;
+      }
+      if (*tag == 0xde || *tag == 0xdf)
+        return take_be(*tag == 0xde ? 2 : 4, length);
+      return false;
+    }
+
+    bool string(const char *&data, size_t &length)
+    {
+      const uint8_t *tag;
+      if (!take(1, tag))
+        return false;
+      uint64_t string_length;
+      if ((*tag & 0xe0) == 0xa0)
+        string_length = *tag & 0x1f;
+      else if (*tag < 0xd9 || *tag > 0xdb || !take_be(1 << (*tag - 0xd9), string_length))
+        return false;
+      const uint8_t *string_data;
+      if (string_length > static_cast<uint64_t>(end - position) || !take(string_length, string_data))
+        return false;
+      data = reinterpret_cast<const char *>(string_data);
+      length = string_length;
+      return true;
+    }
+
+    // Skips the next value, returning where it is encoded.
+    bool value(const char *&data, size_t &length)
+    {
+      const uint8_t *start = position;
+      if (!skip_value(0))
+        return false;
+      data = reinterpret_cast<const char *>(start);
+      length = position - start;
+      return true;
+    }
+
+    bool at_end() const { return position == end; }
+};
+
+// Encodes V8 values following JSON.stringify() semantics: toJSON() is
+// called, functions, symbols and undefined are skipped in objects and become
+// nil in arrays, non-finite numbers become nil, and cycles are an error.
+// Runs user code (toJSON, getters, proxy traps), so call it in the user's
+// context, under the same limits as the code itself. On failure, an
+// exception is pending on the isolate.
+class Encoder {
+  private:
+    v8::Isolate *isolate;
+    v8::Local<v8::Context> context;
+    Writer &writer;
+    std::vector<v8::Local<v8::Object>> stack;
+    v8::Local<v8::String> to_json_string;
+
+  public:
+    Encoder(v8::Local<v8::Context> context, Writer &writer) :
+        isolate(context->GetIsolate()),
+        context(context),
+        writer(writer),
+        to_json_string(v8::String::NewFromUtf8(isolate, "toJSON", v8::NewStringType::kInternalized).ToLocalChecked())
+    {
+    }
+
+    bool encode(v8::Local<v8::Value> value)
+    {
+      bool skipped;
+      if (!encode_value(v8::String::Empty(isolate), value, skipped))
+        return false;
+      if (skipped)
+        writer.nil();
+      return true;
+    }
+
+  private:
+    bool encode_value(v8::Local<v8::Value> key, v8::Local<v8::Value> value, bool &skipped)
+    {
+      skipped = false;
+
+      if (value->IsObject() || value->IsBigInt()) {
+        v8::Local<v8::Value> to_json;
+        if (value->IsObject() && !v8::Local<v8::Object>::Cast(value)->Get(context, to_json_string).ToLocal(&to_json))
+          return false;
+        if (!to_json.IsEmpty() && to_json->IsFunction()) {
+          v8::Local<v8::Value> args[] = {key};
+          if (!v8::Local<v8::Function>::Cast(to_json)->Call(context, value, 1, args).ToLocal(&value))
+            return false;
+        }
+      }
+
+      if (value->IsNull()) {
+        writer.nil();
+      } else if (value->IsTrue()) {
+        writer.boolean(true);
+      } else if (value->IsFalse()) {
+        writer.boolean(false);
+      } else if (value->IsNumber()) {
+        encode_number(v8::Local<v8::Number>::Cast(value)->Value());
+      } else if (value->IsString()) {
+        writer.string(isolate, v8::Local<v8::String>::Cast(value));
+      } else if (value->IsUndefined() || value->IsFunction() || value->IsSymbol()) {
+        skipped = true;
+      } else if (value->IsBigInt() || value->IsBigIntObject()) {
+        return throw_error(v8::Exception::TypeError, "Do not know how to serialize a BigInt");
+      } else if (value->IsNumberObject()) {
+        encode_number(v8::Local<v8::NumberObject>::Cast(value)->ValueOf());
+      } else if (value->IsStringObject()) {
+        writer.string(isolate, v8::Local<v8::StringObject>::Cast(value)->ValueOf());
+      } else if (value->IsBooleanObject()) {
+        writer.boolean(v8::Local<v8::BooleanObject>::Cast(value)->ValueOf());
+      } else if (value->IsObject()) {
+        v8::Local<v8::Object> object = v8::Local<v8::Object>::Cast(value);
+        for (v8::Local<v8::Object> ancestor : stack) {
+          if (ancestor->StrictEquals(object))
+            return throw_error(v8::Exception::TypeError, "Converting circular structure to MessagePack");
+        }
+        if (stack.size() >= kMaxDepth)
+          return throw_error(v8::Exception::RangeError, "Maximum nesting depth exceeded");
+
+        stack.push_back(object);
+        bool success = value->IsArray() ? encode_array(v8::Local<v8::Array>::Cast(value)) : encode_object(object);
+        stack.pop_back();
+        return success;
+      } else {
+        skipped = true;
+      }
+      return true;
+    }
+
+    void encode_number(double value)
+    {
+      if (std::isfinite(value))
+        writer.number(value);
+      else
+        writer.nil();
+    }
+
+    bool encode_array(v8::Local<v8::Array> array)
+    {
+      uint32_t length = array->Length();
+      writer.array_header(length);
+      for (uint32_t i = 0; i < length; i++) {
+        v8::Local<v8::Value> element;
+        if (!array->Get(context, i).ToLocal(&element))
+          return false;
+        bool skipped;
+        if (!encode_value(v8::Integer::NewFromUnsigned(isolate, i)->ToString(context).ToLocalChecked(), element, skipped))
+          return false;
+        if (skipped)
+          writer.nil();
+      }
+      return true;
+    }
+
+    bool encode_object(v8::Local<v8::Object> object)
+    {
+      v8::Local<v8::Array> keys;
+      if (!object->GetOwnPropertyNames(context, static_cast<v8::PropertyFilter>(v8::ONLY_ENUMERABLE | v8::SKIP_SYMBOLS), v8::KeyConversionMode::kConvertToString).ToLocal(&keys))
+        return false;
+
+      size_t header = writer.reserve_header();
+      uint32_t written = 0;
+      for (uint32_t i = 0; i < keys->Length(); i++) {
+        v8::Local<v8::Value> key;
+        v8::Local<v8::Value> element;
+        if (!keys->Get(context, i).ToLocal(&key) || !object->Get(context, key).ToLocal(&element))
+          return false;
+
+        size_t key_position = writer.size();
+        writer.string(isolate, v8::Local<v8::String>::Cast(key));
+        bool skipped;
+        if (!encode_value(key, element, skipped))
+          return false;
+        if (skipped)
+          writer.rewind(key_position);
+        else
+          written++;
+      }
+      writer.finish_map_header(header, written);
+      return true;
+    }
+
+    bool throw_error(v8::Local<v8::Value> (*error)(v8::Local<v8::String>), const char *message)
+    {
+      isolate->ThrowException(error(v8::String::NewFromUtf8(isolate, message, v8::NewStringType::kNormal).ToLocalChecked()));
+      return false;
+    }
+};
+
+}
+}
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <v8-profiler.h>
+#include "json-writer.h"
+
+namespace eval {
+
+// Like IsolateDeleter, for profilers.
+struct CpuProfilerDeleter {
+  void operator()(v8::CpuProfiler *profiler) const { profiler->Dispose(); }
+};
+typedef std::unique_ptr<v8::CpuProfiler, CpuProfilerDeleter> OwnedCpuProfiler;
+
+// Where a sample of runs spent their CPU time, by script (as identified by
+// the ID registering it would give it) and by function within it, for a
+// report of the most expensive ones. Profiling a run is not free (V8 has to
+// log all code of the isolate first, and interrupts the thread at every
+// sample), so only every Nth request of each thread is profiled.
+class ScriptProfiles {
+  public:
+    // How often profiled runs are sampled, in us.
+    static constexpr int kSamplingInterval = 100;
+
+  private:
+    static constexpr size_t kMaxScripts = 1000;
+    static constexpr size_t kReportedScripts = 20;
+    static constexpr size_t kReportedFunctions = 10;
+
+    struct Function {
+      std::string name;
+      std::string resource; // "<user-code>" for functions of the script itself
+      int line;
+      uint64_t samples;
+    };
+
+    struct Script {
+      uint64_t runs = 0;
+      uint64_t cpu_time = 0; // in ns, measured, not sampled
+      uint64_t samples = 0;
+      std::unordered_map<std::string, Function> functions;
+    };
+
+    std::mutex mutex;
+    const uint64_t sample_every;
+    std::unordered_map<std::string, Script> scripts;
+
+    // Functions that samples were taken in, with a key that is the same for
+    // all their nodes in the call tree.
+    static void collect(const v8::CpuProfileNode *node, std::vector<std::pair<std::string, Function>> &functions)
+    {
+      if (node->GetHitCount() != 0) {
+        Function function{node->GetFunctionNameStr(), node->GetScriptResourceNameStr(), node->GetLineNumber(), node->GetHitCount()};
+        if (function.name.empty())
+          function.name = "(anonymous)";
+        std::string key = function.name + '\0' + function.resource + '\0' + std::to_string(function.line);
+        functions.emplace_back(std::move(key), std::move(function));
+      }
+      for (int i = 0; i < node->GetChildrenCount(); i++)
+        collect(node->GetChild(i), functions);
+    }
+
+    template <class Map, class Cost>
+    static std::vector<typename Map::const_pointer> most_expensive(const Map &map, size_t count, Cost &&cost)
+    {
+      std::vector<typename Map::const_pointer> entries;
+      for (const auto &entry : map)
+        entries.push_back(&entry);
+      count = std::min(count, entries.size());
+      std::partial_sort(entries.begin(), entries.begin() + count, entries.end(), [&](typename Map::const_pointer a, typename Map::const_pointer b) {
+        return cost(a->second) > cost(b->second);
+      });
+      entries.resize(count);
+      return entries;
+    }
+
+  public:
+    // Profiles every sample_every-th request of each thread, 0 for none.
+    ScriptProfiles(uint64_t sample_every) : sample_every(sample_every) {}
+
+    bool enabled() const { return sample_every != 0; }
+
+    // Whether to profile a thread's request_number-th request.
+    bool sample(uint64_t request_number) const
+    {
+      return sample_every != 0 && request_number % sample_every == 0;
+    }
+
+    // Adds a profiled run of a script, which used cpu_time ns.
+    void add(const std::string &script_id, uint64_t cpu_time, const v8::CpuProfile *profile)
+    {
+      std::vector<std::pair<std::string, Function>> functions;
+      collect(profile->GetTopDownRoot(), functions);
+
+      std::lock_guard<std::mutex> lock(mutex);
+      auto found = scripts.find(script_id);
+      if (found == scripts.end()) {
+        // Make room by forgetting the cheapest script.
+        if (scripts.size() >= kMaxScripts) {
+          scripts.erase(std::min_element(scripts.begin(), scripts.end(), [](const auto &a, const auto &b) {
+            return a.second.cpu_time < b.second.cpu_time;
+          }));
+        }
+        found = scripts.emplace(script_id, Script()).first;
+      }
+      Script &script = found->second;
+      script.runs++;
+      script.cpu_time += cpu_time;
+      for (auto &function : functions) {
+        script.samples += function.second.samples;
+        auto existing = script.functions.emplace(function.first, function.second);
+        if (!existing.second)
+          existing.first->second.samples += function.second.samples;
+      }
+    }
+
+    // The most expensive scripts, each with its most expensive functions, as
+    // a JSON object. Times are in ms, those of functions estimated from their
+    // samples.
+    void write_json(std::ostream &out)
+    {
+      std::string buffer;
+      JsonWriter json(buffer);
+      std::lock_guard<std::mutex> lock(mutex);
+      json.raw("{\"sampling_interval\":");
+      json.number(kSamplingInterval / 1e3);
+      json.raw(",\"scripts\":[");
+      bool first_script = true;
+      for (auto script : most_expensive(scripts, kReportedScripts, [](const Script &script) { return script.cpu_time; })) {
+        json.raw(first_script ? "{\"script_id\":" : ",{\"script_id\":");
+        json.string(script->first);
+        json.raw(",\"runs\":");
+        json.integer(script->second.runs);
+        json.raw(",\"cpu_time\":");
+        json.number(script->second.cpu_time / 1e6);
+        json.raw(",\"samples\":");
+        json.integer(script->second.samples);
+        json.raw(",\"functions\":[");
+        bool first_function = true;
+        for (auto function : most_expensive(script->second.functions, kReportedFunctions, [](const Function &function) { return function.samples; })) {
+          json.raw(first_function ? "{\"name\":" : ",{\"name\":");
+          json.string(function->second.name);
+          json.raw(",\"resource\":");
+          json.string(function->second.resource);
+          json.raw(",\"line\":");
+          json.number(function->second.line);
+          json.raw(",\"samples\":");
+          json.integer(function->second.samples);
+          json.raw(",\"self_time\":");
+          json.number(function->second.samples * kSamplingInterval / 1e3);
+          json.raw('}');
+          first_function = false;
+        }
+        json.raw("]}");
+        first_script = false;
+      }
+      json.raw("]}");
+      out << buffer;
+    }
+};
+
+}
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "json-tape.h"
+#include "msgpack.h"
+
+namespace eval {
+
+// Process-wide cache of the responses to requests that declared their code
+// pure ("pure": true), i.e. that its result depends on nothing but the
+// request. Keyed by the request in a canonical form (see result_key_*()), so
+// that hits are answered without entering V8. Bounded in size, least
+// recently used entries are evicted first, and entries expire after a while
+// even if used.
+class ResultCache {
+  public:
+    struct Stats {
+      uint64_t hits;
+      uint64_t misses;
+      uint64_t evictions;
+      uint64_t expirations; // found, but too old
+      size_t entries;
+      size_t size;
+    };
+
+  private:
+    // Rough per-entry bookkeeping cost, counted against the size limit.
+    static constexpr size_t kEntryOverhead = 128;
+
+    struct Entry {
+      const std::string *key; // the key in the index
+      std::shared_ptr<const std::string> response;
+      std::chrono::steady_clock::time_point expires;
+      size_t size() const { return key->size() + response->size() + kEntryOverhead; }
+    };
+
+    const size_t max_size;
+    const std::chrono::milliseconds ttl;
+    std::mutex mutex;
+    std::list<Entry> entries; // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    size_t size = 0;
+
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> evictions{0};
+    std::atomic<uint64_t> expirations{0};
+
+    // Must hold the mutex.
+    void erase(std::list<Entry>::iterator entry)
+    {
+      size -= entry->size();
+      const std::string *key = entry->key;
+      entries.erase(entry);
+      index.erase(index.find(*key));
+    }
+
+  public:
+    ResultCache(size_t max_size, std::chrono::milliseconds ttl) : max_size(max_size), ttl(ttl) {}
+
+    bool enabled() const { return max_size > 0 && ttl.count() > 0; }
+
+    // Returns the response for the key, or nullptr. The response stays valid
+    // for as long as the caller holds on to it.
+    std::shared_ptr<const std::string> lookup(const std::string &key)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto found = index.find(key);
+      if (found != index.end() && found->second->expires <= std::chrono::steady_clock::now()) {
+        erase(found->second);
+        expirations++;
+        found = index.end();
+      }
+      if (found == index.end()) {
+        misses++;
+        return nullptr;
+      }
+      hits++;
+      entries.splice(entries.begin(), entries, found->second);
+      return found->second->response;
+    }
+
+    void insert(const std::string &key, std::shared_ptr<const std::string> response)
+    {
+      size_t entry_size = key.size() + response->size() + kEntryOverhead;
+      if (entry_size > max_size)
+        return;
+
+      std::lock_guard<std::mutex> lock(mutex);
+      auto found = index.find(key);
+      if (found != index.end())
+        erase(found->second);
+      while (size + entry_size > max_size) {
+        erase(std::prev(entries.end()));
+        evictions++;
+      }
+      auto inserted = index.emplace(key, entries.end()).first;
+      entries.push_front(Entry{&inserted->first, std::move(response), std::chrono::steady_clock::now() + ttl});
+      inserted->second = entries.begin();
+      size += entry_size;
+    }
+
+    Stats stats()
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      return Stats{hits, misses, evictions, expirations, entries.size(), size};
+    }
+};
+
+// The request fields a response depends on, in the order they go into a key.
+// Other fields are ignored by the server, and so by the key. Requests with
+// "timings": true are not memoized, their timings would be those of the
+// first run.
+constexpr const char *kResultKeyFields[] = {"code", "script_id", "context", "contexts", "timeout", "lazy_context"};
+
+inline void append_key_length(std::string &key, size_t length)
+{
+  uint32_t length32 = length;
+  key.append(reinterpret_cast<const char *>(&length32), sizeof(length32));
+}
+
+// Appends a JSON value in a form that is the same for all documents JSON.parse()
+// creates the same value from: whitespace, escapes and number notation do not
+// matter. Key order does, since code can observe it.
+inline void append_canonical_json(std::string &key, const JsonTape &tape, uint32_t index)
+{
+  const JsonTape::Node &node = tape[index];
+  key += static_cast<char>(node.type);
+  switch (node.type) {
+    case JsonTape::Type::number: {
+      double number = strtod(std::string(node.data, node.length).c_str(), nullptr);
+      key.append(reinterpret_cast<const char *>(&number), sizeof(number));
+      break;
+    }
+    case JsonTape::Type::string:
+      append_key_length(key, node.length);
+      key.append(node.data, node.length);
+      break;
+    case JsonTape::Type::array:
+    case JsonTape::Type::object:
+      append_key_length(key, node.count);
+      for (uint32_t child = index + 1; child < node.next; child = tape[child].next)
+        append_canonical_json(key, tape, child);
+      break;
+    default:
+      break;
+  }
+}
+
+// Builds the result cache key of a JSON request that was parsed into the
+// tape. Returns false if the request is not pure, not an evaluation, or
+// asks for timings.
+inline bool result_key_json(const JsonTape &tape, std::string &key)
+{
+  uint32_t pure = tape[0].type == JsonTape::Type::object ? tape.find(0, "pure", 4) : 0;
+  if (pure == 0 || tape[pure].type != JsonTape::Type::boolean_true || tape.find(0, "op", 2) != 0)
+    return false;
+  uint32_t timings = tape.find(0, "timings", 7);
+  if (timings != 0 && tape[timings].type == JsonTape::Type::boolean_true)
+    return false;
+
+  key.assign("j");
+  for (const char *field : kResultKeyFields) {
+    uint32_t value = tape.find(0, field, strlen(field));
+    if (value == 0)
+      key += '-';
+    else
+      append_canonical_json(key, tape, value);
+  }
+  return true;
+}
+
+// Builds the result cache key of a MessagePack request. Values are taken as
+// encoded, which is canonical enough for requests from the same client.
+// Returns false if the request is not pure, not an evaluation, or asks for
+// timings.
+inline bool result_key_msgpack(const std::string &blob, std::string &key)
+{
+  constexpr size_t kFieldCount = sizeof(kResultKeyFields) / sizeof(kResultKeyFields[0]);
+  const char *values[kFieldCount] = {};
+  size_t value_lengths[kFieldCount] = {};
+  bool pure = false;
+
+  msgpack::Scanner scanner(blob);
+  uint64_t count;
+  if (!scanner.map_header(count))
+    return false;
+  for (uint64_t i = 0; i < count; i++) {
+    const char *name, *value;
+    size_t name_length, value_length;
+    if (!scanner.string(name, name_length) || !scanner.value(value, value_length))
+      return false;
+    if (name_length == 2 && memcmp(name, "op", 2) == 0)
+      return false;
+    if (name_length == 4 && memcmp(name, "pure", 4) == 0)
+      pure = value_length == 1 && static_cast<uint8_t>(*value) == 0xc3;
+    if (name_length == 7 && memcmp(name, "timings", 7) == 0 && value_length == 1 && static_cast<uint8_t>(*value) == 0xc3)
+      return false;
+    for (size_t field = 0; field < kFieldCount; field++) {
+      if (name_length == strlen(kResultKeyFields[field]) && memcmp(name, kResultKeyFields[field], name_length) == 0) {
+        values[field] = value;
+        value_lengths[field] = value_length;
+      }
+    }
+  }
+  if (!pure || !scanner.at_end())
+    return false;
+
+  key.assign("m");
+  for (size_t field = 0; field < kFieldCount; field++) {
+    append_key_length(key, value_lengths[field]);
+    key.append(values[field] ? values[field] : "", value_lengths[field]);
+  }
+  return true;
+}
+
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace eval {
+
+// A script uploaded once and then invoked by ID, with its code cache data
+// produced at registration, so isolates never have to compile it from source.
+struct RegisteredScript {
+  std::string code;
+  std::shared_ptr<const std::string> code_cache_data; // may be empty
+};
+
+// Process-wide set of registered scripts, shared by all threads. Unlike the
+// code cache, nothing is evicted: registering fails once the limit is hit,
+// and scripts are removed only when unregistered.
+class ScriptRegistry {
+  public:
+    enum class Result { ok, full, conflict };
+
+  private:
+    // Rough per-script bookkeeping cost, counted against the size limit.
+    static constexpr size_t kScriptOverhead = 256;
+
+    const size_t max_size;
+    std::mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<const RegisteredScript>> scripts;
+    size_t size = 0;
+    std::atomic<uint64_t> generation{0};
+
+    static size_t script_size(const std::string &id, const RegisteredScript &script)
+    {
+      return id.size() + script.code.size() + (script.code_cache_data ? script.code_cache_data->size() : 0) + kScriptOverhead;
+    }
+
+  public:
+    ScriptRegistry(size_t max_size) : max_size(max_size) {}
+
+    // The ID of a script is derived from its code (64-bit FNV-1a, in hex),
+    // so it is stable across registrations and restarts, and clients can
+    // compute it themselves.
+    static std::string id_for(const std::string &code)
+    {
+      uint64_t hash = 0xcbf29ce484222325ull;
+      for (unsigned char c : code) {
+        hash ^= c;
+        hash *= 0x100000001b3ull;
+      }
+      char id[17];
+      snprintf(id, sizeof(id), "%016llx", static_cast<unsigned long long>(hash));
+      return std::string(id, 16);
+    }
+
+    // Registering the same code again is a no-op.
+    Result add(const std::string &id, std::shared_ptr<const RegisteredScript> script)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto found = scripts.find(id);
+      if (found != scripts.end())
+        return found->second->code == script->code ? Result::ok : Result::conflict;
+
+      size_t added_size = script_size(id, *script);
+      if (size + added_size > max_size)
+        return Result::full;
+      scripts.emplace(id, std::move(script));
+      size += added_size;
+      return Result::ok;
+    }
+
+    bool remove(const std::string &id)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto found = scripts.find(id);
+      if (found == scripts.end())
+        return false;
+      size -= script_size(id, *found->second);
+      scripts.erase(found);
+      generation++;
+      return true;
+    }
+
+    std::shared_ptr<const RegisteredScript> find(const std::string &id)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto found = scripts.find(id);
+      return found == scripts.end() ? nullptr : found->second;
+    }
+
+    // Changes whenever a script is removed, so threads know when to drop
+    // their own state for it.
+    uint64_t current_generation() const { return generation; }
+};
+
+}
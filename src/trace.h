@@ -0,0 +1,140 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "error-handling.h"
+
+namespace eval {
+
+// What a request spends its time on, from waiting for a thread to writing
+// the response.
+enum class Phase { queue, parse, compile, run, serialize, respond };
+constexpr size_t kPhaseCount = 6;
+
+inline const char *phase_name(Phase phase)
+{
+  static const char *const names[kPhaseCount] = {"queue", "parse", "compile", "run", "serialize", "respond"};
+  return names[static_cast<size_t>(phase)];
+}
+
+// Wall-clock time of a request's phases, added up (batch requests compile,
+// run and serialize once per item), and for requests that are traced, every
+// span on its own.
+class RequestTimings {
+  public:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Span {
+      Phase phase;
+      Clock::time_point begin;
+      Clock::time_point end;
+    };
+
+  private:
+    std::array<uint64_t, kPhaseCount> totals = {}; // in ns
+    std::vector<Span> spans;
+    bool traced = false;
+
+  public:
+    void trace() { traced = true; }
+    bool is_traced() const { return traced; }
+    const std::vector<Span> &traced_spans() const { return spans; }
+
+    void record(Phase phase, Clock::time_point begin, Clock::time_point end)
+    {
+      totals[static_cast<size_t>(phase)] += std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+      if (traced)
+        spans.push_back(Span{phase, begin, end});
+    }
+
+    uint64_t total(Phase phase) const { return totals[static_cast<size_t>(phase)]; }
+};
+
+// A sample of requests' phases, written to a file in the Chrome trace event
+// format: a JSON array of complete events, which is never closed (the format
+// allows the closing bracket to be missing, so that the file can be read
+// while it is written). Each request is an event of its own, with its phases
+// nested in it, on the thread that handled it. Requests are written with a
+// single fwrite, which the stream locks itself, and are only flushed by
+// flush(), off the requests' path.
+class TraceLog {
+  private:
+    typedef RequestTimings::Clock Clock;
+
+    FILE *file = nullptr;
+    const uint64_t sample_every;
+    const Clock::time_point epoch = Clock::now();
+
+    int64_t micros(Clock::time_point time) const { return std::chrono::duration_cast<std::chrono::microseconds>(time - epoch).count(); }
+
+  public:
+    // Traces every sample_every-th request of each thread, no file for none.
+    TraceLog(const std::string &path, uint64_t sample_every) :
+        sample_every(sample_every)
+    {
+      if (path.empty() || sample_every == 0)
+        return;
+      if (!(file = fopen(path.c_str(), "w")))
+        throw_with_trace(std::system_error(errno, std::generic_category(), "Cannot open trace file " + path));
+      fputs("[\n", file);
+      fflush(file);
+    }
+
+    ~TraceLog()
+    {
+      if (file)
+        fclose(file);
+    }
+
+    bool enabled() const { return file; }
+
+    // Whether to trace a thread's request_number-th request.
+    bool sample(uint64_t request_number) const
+    {
+      return file && request_number % sample_every == 0;
+    }
+
+    void write(const RequestTimings &timings, const char *outcome)
+    {
+      const std::vector<RequestTimings::Span> &spans = timings.traced_spans();
+      if (spans.empty())
+        return;
+      Clock::time_point begin = spans.front().begin, end = spans.front().end;
+      for (const RequestTimings::Span &span : spans) {
+        begin = std::min(begin, span.begin);
+        end = std::max(end, span.end);
+      }
+
+      long thread_id = syscall(SYS_gettid);
+      std::stringstream events;
+      auto event = [&](const char *name, Clock::time_point begin, Clock::time_point end) {
+        events << "{\"name\":\"" << name << "\",\"ph\":\"X\",\"pid\":" << getpid() << ",\"tid\":" << thread_id
+               << ",\"ts\":" << micros(begin) << ",\"dur\":" << micros(end) - micros(begin);
+      };
+      event("request", begin, end);
+      events << ",\"args\":{\"outcome\":\"" << outcome << "\"}},\n";
+      for (const RequestTimings::Span &span : spans) {
+        event(phase_name(span.phase), span.begin, span.end);
+        events << "},\n";
+      }
+
+      std::string data = events.str();
+      fwrite(data.data(), 1, data.size(), file);
+    }
+
+    void flush()
+    {
+      if (file)
+        fflush(file);
+    }
+};
+
+}
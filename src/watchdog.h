@@ -0,0 +1,368 @@
+#pragma once
+
+#include <algorithm>
+#include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <pthread.h>
+#include <system_error>
+#include <thread>
+#include <time.h>
+#include <unordered_set>
+#include <vector>
+#include <v8.h>
+#include "error-handling.h"
+
+namespace eval {
+
+// CPU time of the thread that created it, not counting time spent in GC.
+// Can be read from any thread.
+class CpuClock {
+  private:
+    clockid_t clockid;
+    std::atomic<uint64_t> gc_total{0};
+    std::atomic<uint64_t> current_gc_start{0}; // 0 if not in GC
+
+  public:
+    CpuClock()
+    {
+      if (pthread_getcpuclockid(pthread_self(), &clockid) != 0)
+        throw_with_trace(std::system_error(errno, std::generic_category(), "Cannot get clock id"));
+    }
+
+    // Including GC.
+    uint64_t now() const
+    {
+      struct timespec time;
+      if (clock_gettime(clockid, &time) != 0)
+        throw_with_trace(std::system_error(errno, std::generic_category(), "Cannot get time"));
+      return time.tv_sec * 1e9 + time.tv_nsec;
+    }
+
+    uint64_t gc_time() const { return gc_total; }
+
+    // Time used since the given now() and gc_time(), excluding GC. From
+    // another thread, a GC may end while this reads: the GC total is read
+    // again until it is the same on both sides of the GC start, and a GC
+    // counted twice for a moment (total added to, start not cleared yet)
+    // makes the result low, never wrap around.
+    uint64_t used_since(uint64_t start, uint64_t gc_time_at_start) const
+    {
+      uint64_t gc, gc_start;
+      do {
+        gc = gc_total;
+        gc_start = current_gc_start;
+      } while (gc != gc_total);
+      uint64_t end = gc_start ? gc_start : now();
+      uint64_t used = end > start ? end - start : 0;
+      uint64_t gc_used = gc - gc_time_at_start;
+      return used > gc_used ? used - gc_used : 0;
+    }
+
+    void gc_prologue()
+    {
+      assert(current_gc_start == 0);
+      current_gc_start = now();
+    }
+
+    // Adds to the total before clearing the start, see used_since().
+    void gc_epilogue()
+    {
+      assert(current_gc_start != 0);
+      gc_total += now() - current_gc_start;
+      current_gc_start = 0;
+    }
+};
+
+// A hierarchical timer wheel with a resolution of one tick: kLevels wheels
+// of kSlots slots, each level's slots spanning a whole turn of the level
+// below. Timers are moved down a level when the wheel reaches their slot.
+// Timers beyond the last level fire early, at its end, and are expected to
+// be rescheduled.
+template <class Timer>
+class TimerWheel {
+  private:
+    static constexpr int kLevels = 4;
+    static constexpr int kSlotBits = 6;
+    static constexpr uint64_t kSlots = 1 << kSlotBits;
+    static constexpr uint64_t kMaxDelta = (uint64_t(1) << (kLevels * kSlotBits)) - 1;
+
+    struct Entry {
+      uint64_t expiry;
+      Timer timer;
+    };
+
+    std::vector<Entry> slots[kLevels][kSlots];
+    uint64_t current = 0;
+    size_t count = 0;
+
+    void place(Entry &&entry)
+    {
+      uint64_t delta = entry.expiry - current;
+      int level = 0;
+      while (level < kLevels - 1 && delta >= (uint64_t(1) << ((level + 1) * kSlotBits)))
+        level++;
+      slots[level][(entry.expiry >> (level * kSlotBits)) & (kSlots - 1)].push_back(std::move(entry));
+    }
+
+  public:
+    TimerWheel(uint64_t now) : current(now) {}
+
+    bool empty() const { return count == 0; }
+
+    void insert(uint64_t expiry, const Timer &timer)
+    {
+      expiry = std::min(std::max(expiry, current + 1), current + kMaxDelta);
+      place(Entry{expiry, timer});
+      count++;
+    }
+
+    // Advances the wheel to the given tick, calling expired(timer) for every
+    // timer that is due (which may insert new ones).
+    template <class Expired>
+    void advance(uint64_t now, Expired &&expired)
+    {
+      if (count == 0 && now > current)
+        current = now;
+      while (current < now) {
+        current++;
+        for (int level = 1; level < kLevels && (current & ((uint64_t(1) << (level * kSlotBits)) - 1)) == 0; level++) {
+          std::vector<Entry> cascaded;
+          cascaded.swap(slots[level][(current >> (level * kSlotBits)) & (kSlots - 1)]);
+          for (Entry &entry : cascaded)
+            place(std::move(entry));
+        }
+        std::vector<Entry> due;
+        due.swap(slots[0][current & (kSlots - 1)]);
+        count -= due.size();
+        for (Entry &entry : due)
+          expired(entry.timer);
+      }
+    }
+
+    // Drops all timers for which the predicate is true.
+    template <class Predicate>
+    void remove_if(Predicate &&predicate)
+    {
+      for (auto &level : slots) {
+        for (auto &slot : level) {
+          size_t size = slot.size();
+          slot.erase(std::remove_if(slot.begin(), slot.end(), [&](const Entry &entry) { return predicate(entry.timer); }), slot.end());
+          count -= size - slot.size();
+        }
+      }
+    }
+};
+
+// Terminates scripts that exceed their CPU time limit, for all isolates in
+// the process, from a single thread. Arming and disarming are lock-free (an
+// atomic store and a compare-and-swap): the watchdog picks up newly armed
+// isolates on its next tick and checks them once their limit could have
+// been reached in wall-clock time, which CPU time cannot outpace. Scripts
+// that finish before that are never checked at all. While nothing is armed
+// for a while, the thread sleeps until something is.
+class CpuWatchdog {
+  public:
+    // An isolate's registration with the watchdog, owned by its thread.
+    class Slot {
+      friend class CpuWatchdog;
+      private:
+        enum Status : uint64_t { disarmed, armed, firing, fired };
+        static constexpr int kStatusBits = 2;
+
+        CpuWatchdog &watchdog;
+        v8::Isolate *isolate;
+        const CpuClock &clock;
+
+        // Sequence number of the arming, and its status. The fields below
+        // are published by storing it.
+        std::atomic<uint64_t> state{0};
+        std::atomic<uint64_t> limit{0};
+        std::atomic<uint64_t> start{0};
+        std::atomic<uint64_t> gc_time_at_start{0};
+        std::atomic<uint64_t> armed_at{0}; // in watchdog ticks
+
+        uint64_t seen_sequence = 0; // by the watchdog thread
+
+        static uint64_t sequence_of(uint64_t state) { return state >> kStatusBits; }
+        static Status status_of(uint64_t state) { return static_cast<Status>(state & ((1 << kStatusBits) - 1)); }
+
+      public:
+        Slot(CpuWatchdog &watchdog, v8::Isolate *isolate, const CpuClock &clock) :
+            watchdog(watchdog),
+            isolate(isolate),
+            clock(clock)
+        {
+          watchdog.add(this);
+        }
+
+        ~Slot()
+        {
+          watchdog.remove(this);
+        }
+
+        // Starts watching a script that started running at the given clock
+        // time and GC time, with the given limit (all in ns).
+        void arm(uint64_t limit, uint64_t start, uint64_t gc_time_at_start)
+        {
+          uint64_t current = state.load(std::memory_order_relaxed);
+          assert(status_of(current) == disarmed);
+          this->limit.store(limit, std::memory_order_relaxed);
+          this->start.store(start, std::memory_order_relaxed);
+          this->gc_time_at_start.store(gc_time_at_start, std::memory_order_relaxed);
+          armed_at.store(watchdog.ticks(), std::memory_order_relaxed);
+          state.store(((sequence_of(current) + 1) << kStatusBits) | armed);
+          watchdog.wake();
+        }
+
+        // Stops watching. Returns whether the script was terminated, in
+        // which case the termination was requested before this returns.
+        bool disarm()
+        {
+          while (true) {
+            uint64_t current = state.load();
+            switch (status_of(current)) {
+              case firing:
+                std::this_thread::yield();
+                continue;
+              case armed:
+              case fired:
+                if (state.compare_exchange_weak(current, (sequence_of(current) << kStatusBits) | disarmed))
+                  return status_of(current) == fired;
+                continue;
+              default:
+                throw_with_trace(std::runtime_error("Unexpected watchdog status"));
+            }
+          }
+        }
+    };
+
+  private:
+    typedef std::chrono::steady_clock Clock;
+    static constexpr std::chrono::microseconds kTick{1000};
+
+    // Ticks without anything armed before the thread goes to sleep.
+    static constexpr int kIdleTicks = 64;
+
+    struct Timer {
+      Slot *slot;
+      uint64_t sequence;
+    };
+
+    const Clock::time_point epoch = Clock::now();
+    std::mutex mutex; // held by the thread while it works
+    std::condition_variable cv;
+    std::unordered_set<Slot *> slots;
+    std::atomic<bool> sleeping{false};
+    bool exiting = false;
+    TimerWheel<Timer> wheel{0};
+    std::thread thread;
+
+    uint64_t ticks() const { return (Clock::now() - epoch) / kTick; }
+
+    static uint64_t ticks_for(uint64_t nanoseconds)
+    {
+      uint64_t tick = std::chrono::duration_cast<std::chrono::nanoseconds>(kTick).count();
+      return (nanoseconds + tick - 1) / tick;
+    }
+
+    void add(Slot *slot)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      slots.insert(slot);
+    }
+
+    void remove(Slot *slot)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      slots.erase(slot);
+      wheel.remove_if([slot](const Timer &timer) { return timer.slot == slot; });
+    }
+
+    void wake()
+    {
+      if (!sleeping.load())
+        return;
+      std::lock_guard<std::mutex> lock(mutex);
+      sleeping = false;
+      cv.notify_one();
+    }
+
+    // Must hold the mutex. Returns whether anything is armed.
+    bool schedule_armed()
+    {
+      bool any_armed = false;
+      for (Slot *slot : slots) {
+        uint64_t state = slot->state.load();
+        if (Slot::status_of(state) != Slot::armed)
+          continue;
+        any_armed = true;
+        uint64_t sequence = Slot::sequence_of(state);
+        if (sequence == slot->seen_sequence)
+          continue;
+        slot->seen_sequence = sequence;
+        wheel.insert(slot->armed_at.load(std::memory_order_relaxed) + ticks_for(slot->limit.load(std::memory_order_relaxed)), Timer{slot, sequence});
+      }
+      return any_armed;
+    }
+
+    // Must hold the mutex.
+    void check(const Timer &timer, uint64_t now)
+    {
+      Slot *slot = timer.slot;
+      uint64_t state = slot->state.load();
+      if (state != ((timer.sequence << Slot::kStatusBits) | Slot::armed))
+        return; // disarmed since, maybe armed again
+      uint64_t limit = slot->limit.load(std::memory_order_relaxed);
+      uint64_t used = slot->clock.used_since(slot->start.load(std::memory_order_relaxed), slot->gc_time_at_start.load(std::memory_order_relaxed));
+      if (used < limit) {
+        wheel.insert(now + ticks_for(limit - used), timer);
+      } else if (slot->state.compare_exchange_strong(state, (timer.sequence << Slot::kStatusBits) | Slot::firing)) {
+        slot->isolate->TerminateExecution();
+        slot->state.store((timer.sequence << Slot::kStatusBits) | Slot::fired);
+      }
+    }
+
+    void thread_main()
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      int idle_ticks = 0;
+      while (!exiting) {
+        uint64_t now = ticks();
+        bool any_armed = schedule_armed();
+        wheel.advance(now, [&](const Timer &timer) { check(timer, now); });
+
+        idle_ticks = any_armed || !wheel.empty() ? 0 : idle_ticks + 1;
+        if (idle_ticks < kIdleTicks) {
+          cv.wait_until(lock, epoch + (now + 1) * kTick, [this]{ return exiting; });
+          continue;
+        }
+
+        // Sleep, unless something was armed before we said so.
+        sleeping = true;
+        if (schedule_armed()) {
+          sleeping = false;
+          continue;
+        }
+        cv.wait(lock, [this]{ return exiting || !sleeping; });
+        idle_ticks = 0;
+      }
+    }
+
+  public:
+    CpuWatchdog() : thread(&CpuWatchdog::thread_main, this) {}
+
+    ~CpuWatchdog()
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        exiting = true;
+        cv.notify_all();
+      }
+      thread.join();
+    }
+};
+
+}
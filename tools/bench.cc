@@ -0,0 +1,197 @@
+// Microbenchmarks of the evaluation pipeline: requests are handled by a
+// ThreadContext directly, without sockets or threads, over and over, and the
+// time each takes is split into creating its context, the phases of
+// RequestTimings, writing error responses (formatting the exception
+// included), and the rest of handling it (e.g. building other responses).
+// Each benchmark is a workload that stresses one of these.
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/program_options.hpp>
+#include "../src/error-handling.h"
+#include "../src/evaluation.h"
+
+namespace po = boost::program_options;
+typedef std::chrono::steady_clock Clock;
+
+struct Benchmark {
+  const char *name;
+  const char *description;
+  std::function<std::string(uint64_t iteration)> request;
+};
+
+// A context of count records, as JSON.
+static std::string records(size_t count)
+{
+  std::stringstream out;
+  out << "{\"data\":[";
+  for (size_t i = 0; i < count; i++)
+    out << (i ? "," : "") << "{\"id\":" << i << ",\"name\":\"item " << i << "\",\"price\":" << i * 1.25 << ",\"tags\":[\"a\",\"b\"],\"active\":true}";
+  out << "]}";
+  return out.str();
+}
+
+// A script of about 50 lines, different in every iteration, so that it is
+// never in the code cache.
+static std::string unique_script(uint64_t iteration)
+{
+  std::stringstream code;
+  code << "const seed = " << iteration << ";\\n";
+  for (int i = 0; i < 16; i++) {
+    code << "function step" << i << "(x) {\\n"
+         << "  if (x % " << i + 2 << " === 0) return x / " << i + 2 << ";\\n"
+         << "  return x * 3 + " << i << ";\\n}\\n";
+  }
+  code << "let x = seed; for (let i = 0; i < 16; i++) x = step0(x); return x;";
+  return code.str();
+}
+
+static std::vector<Benchmark> benchmarks()
+{
+  std::string large_context = records(1000);
+  return {
+    {"context", "minimal request, dominated by creating its context", [](uint64_t) {
+      return std::string("{\"code\":\"return 1\",\"context\":{}}");
+    }},
+    {"parse", "context of 1000 records (~80 kB), not used", [large_context](uint64_t) {
+      return "{\"code\":\"return 1\",\"context\":" + large_context + "}";
+    }},
+    {"compile", "script of 50 lines, new every time", [](uint64_t iteration) {
+      return "{\"code\":\"" + unique_script(iteration) + "\",\"context\":{}}";
+    }},
+    {"tiny", "one-line script, the common case", [](uint64_t iteration) {
+      return "{\"code\":\"return i + 1\",\"context\":{\"i\":" + std::to_string(iteration) + "}}";
+    }},
+    {"stringify", "returns its context of 1000 records", [large_context](uint64_t) {
+      return "{\"code\":\"return data\",\"context\":" + large_context + "}";
+    }},
+    {"error", "script failing three calls deep, formatting its stack trace", [](uint64_t) {
+      return std::string("{\"code\":\"function a() { return null.x; } function b() { return a(); } return b();\",\"context\":{}}");
+    }},
+  };
+}
+
+// Mean time of each part of a request, in ns.
+struct Result {
+  uint64_t iterations = 0;
+  uint64_t context = 0;
+  uint64_t phases[eval::kPhaseCount] = {};
+  uint64_t error = 0;
+  uint64_t other = 0;
+  uint64_t total = 0;
+};
+
+static uint64_t nanoseconds(Clock::duration duration)
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+}
+
+static Result run(eval::ThreadContext &thread, const Benchmark &benchmark, Clock::duration time, std::chrono::milliseconds idle_time)
+{
+  Result result;
+  std::string request_blob;
+  Clock::time_point end = Clock::now() + time;
+  for (uint64_t i = 0; Clock::now() < end; i++) {
+    // Handling may take over the buffer, so it is refilled every time.
+    request_blob = benchmark.request(i);
+    if (idle_time.count() != 0)
+      thread.idle(idle_time);
+
+    Clock::time_point start = Clock::now();
+    eval::RequestContext request(&thread);
+    Clock::time_point created = Clock::now();
+    request.handle_request(request_blob);
+    Clock::time_point handled = Clock::now();
+    request.write_response([](const char *, size_t) {});
+    request.responded(handled);
+    Clock::time_point responded = Clock::now();
+
+    const eval::RequestTimings &timings = request.phase_timings();
+    uint64_t measured = request.error_response_time();
+    for (size_t phase = 0; phase < eval::kPhaseCount; phase++) {
+      result.phases[phase] += timings.total(static_cast<eval::Phase>(phase));
+      if (static_cast<eval::Phase>(phase) != eval::Phase::respond)
+        measured += timings.total(static_cast<eval::Phase>(phase));
+    }
+    result.context += nanoseconds(created - start);
+    result.error += request.error_response_time();
+    result.other += nanoseconds(handled - created) - std::min(measured, nanoseconds(handled - created));
+    result.total += nanoseconds(responded - start);
+    result.iterations++;
+  }
+
+  if (result.iterations) {
+    result.context /= result.iterations;
+    for (uint64_t &phase : result.phases)
+      phase /= result.iterations;
+    result.error /= result.iterations;
+    result.other /= result.iterations;
+    result.total /= result.iterations;
+  }
+  return result;
+}
+
+int main(int argc, char *argv[])
+{
+  GlobalErrorHandler eh;
+
+  std::vector<std::string> selected;
+  double time_s, warmup_s;
+  unsigned idle_time_ms;
+  po::options_description desc("Allowed options");
+  desc.add_options()
+      ("help", "produce help message")
+      ("benchmark", po::value<std::vector<std::string>>(&selected), "benchmark to run (repeatable, defaults to all)")
+      ("time", po::value<double>(&time_s)->default_value(2), "seconds to measure each benchmark for")
+      ("warmup", po::value<double>(&warmup_s)->default_value(0.5), "seconds to run each benchmark for first, unmeasured")
+      ("idle-time", po::value<unsigned>(&idle_time_ms)->default_value(0), "time the thread may spend preparing for the next request, unmeasured, as the server's --idle-time (0 creates every context on demand)")
+  ;
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, desc), vm);
+  po::notify(vm);
+  if (vm.count("help")) {
+      std::cout << desc << "\n";
+      for (const Benchmark &benchmark : benchmarks())
+        std::cout << "  " << std::left << std::setw(12) << benchmark.name << benchmark.description << "\n";
+      return 1;
+  }
+
+  eval::Options options;
+  options.recycle_requests = 0;
+  eval::GlobalContext global_eval_context(options);
+  eval::ThreadMetrics &thread_metrics = global_eval_context.add_thread_metrics();
+  eval::ThreadContext thread_eval_context(&global_eval_context, &thread_metrics);
+
+  auto seconds = [](double s) { return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(s)); };
+  std::cout << "Mean time per request, in us:\n"
+            << std::left << std::setw(12) << "" << std::right << std::setw(12) << "iterations" << std::setw(10) << "context";
+  for (size_t phase = 1; phase < eval::kPhaseCount; phase++)
+    std::cout << std::setw(10) << eval::phase_name(static_cast<eval::Phase>(phase));
+  std::cout << std::setw(10) << "error" << std::setw(10) << "other" << std::setw(10) << "total" << "\n";
+
+  bool any = false;
+  for (const Benchmark &benchmark : benchmarks()) {
+    if (!selected.empty() && std::find(selected.begin(), selected.end(), benchmark.name) == selected.end())
+      continue;
+    any = true;
+    run(thread_eval_context, benchmark, seconds(warmup_s), std::chrono::milliseconds(idle_time_ms));
+    Result result = run(thread_eval_context, benchmark, seconds(time_s), std::chrono::milliseconds(idle_time_ms));
+
+    std::cout << std::left << std::setw(12) << benchmark.name << std::right << std::setw(12) << result.iterations
+              << std::fixed << std::setprecision(1) << std::setw(10) << result.context / 1e3;
+    for (size_t phase = 1; phase < eval::kPhaseCount; phase++)
+      std::cout << std::setw(10) << result.phases[phase] / 1e3;
+    std::cout << std::setw(10) << result.error / 1e3 << std::setw(10) << result.other / 1e3 << std::setw(10) << result.total / 1e3 << std::endl;
+  }
+  if (!any) {
+    std::cerr << "No such benchmark\n";
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,559 @@
+// Load generator: replays a corpus of requests against a running server and
+// reports throughput and latency percentiles, per stage. A stage is either
+// closed-loop (every connection sends its next request as soon as the last
+// one is answered, so the server sets the pace) or open-loop (requests are
+// sent at a fixed rate, whether or not earlier ones are answered, and
+// latency counts from when a request was due, so a server that falls behind
+// cannot hide it).
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/program_options.hpp>
+#include <boost/asio.hpp>
+#include "../src/json-writer.h"
+#include "../src/metrics.h"
+
+namespace po = boost::program_options;
+using boost::asio::ip::tcp;
+typedef std::chrono::steady_clock Clock;
+
+// Reads requests from a file: one per line for .jsonl and .ndjson files,
+// otherwise the whole file is one request. A whole file that is not a JSON
+// object is data instead (e.g. tests/3mb-test.json), and becomes the
+// request {"code": <code>, "context": {"data": <file>}}.
+static bool load_corpus(const std::string &path, const std::string &code, std::vector<std::string> &requests)
+{
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+    return false;
+  auto ends_with = [&](const std::string &suffix) {
+    return path.size() >= suffix.size() && path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0;
+  };
+  if (ends_with(".jsonl") || ends_with(".ndjson")) {
+    std::string line;
+    while (std::getline(file, line)) {
+      if (line.find_first_not_of(" \t\r") != std::string::npos)
+        requests.push_back(line);
+    }
+    return true;
+  }
+
+  std::stringstream contents;
+  contents << file.rdbuf();
+  std::string request = contents.str();
+  size_t first = request.find_first_not_of(" \t\r\n");
+  if (first == std::string::npos || request[first] != '{') {
+    std::string wrapped;
+    eval::JsonWriter json(wrapped);
+    json.raw("{\"code\":");
+    json.string(code);
+    json.raw(",\"context\":{\"data\":");
+    json.raw(request.data(), request.size());
+    json.raw("}}");
+    request = std::move(wrapped);
+  }
+  requests.push_back(std::move(request));
+  return true;
+}
+
+struct Settings {
+  tcp::endpoint endpoint;
+  bool framed;
+  size_t connections;
+  Clock::duration warmup;
+  Clock::duration duration;
+  Clock::duration drain; // how long to wait for the last responses
+};
+
+class FramedConnection;
+
+// One stage of the run, at one rate (0 for closed-loop). Requests are sent
+// over the given number of connections, or with --protocol plain, that many
+// at a time, each on a connection of its own. Open-loop plain requests that
+// are due while that many are outstanding wait for one to finish, their
+// latency still counted from when they were due. A framed connection that
+// fails is replaced, and in the closed loop, a failed request is followed
+// by the next one like an answered one, so that concurrency is kept. Only
+// requests sent after the warmup are measured.
+class Stage {
+  friend class FramedConnection;
+  friend class PlainRequest;
+  private:
+    boost::asio::io_service io_service; // first, so that pending handlers go last
+    const Settings &settings;
+    const std::vector<std::string> &corpus;
+    const double rate;
+
+    Clock::time_point start;
+    Clock::time_point measure_from;
+    Clock::time_point measure_until;
+    boost::asio::steady_timer timer{io_service};
+    boost::asio::steady_timer drain_timer{io_service};
+    std::vector<std::shared_ptr<FramedConnection>> connections;
+    uint64_t issued = 0;
+    uint64_t outstanding = 0;
+    bool sending = true;
+
+    // Plain requests that were due while all slots were taken.
+    struct Waiting {
+      const std::string *request;
+      Clock::time_point sent_at;
+    };
+    std::deque<Waiting> waiting;
+
+    // Of the measured requests.
+    uint64_t sent = 0;
+    uint64_t completed = 0;
+    uint64_t errors = 0; // connections that failed
+    std::map<std::string, uint64_t> statuses;
+    eval::Histogram latency;
+
+    bool measured(Clock::time_point sent_at) const { return sent_at >= measure_from && sent_at < measure_until; }
+
+    // Sends the next request of the corpus, in the given slot (connection).
+    // Defined after the connections, like the rest that uses them.
+    void issue(size_t slot, Clock::time_point sent_at);
+    void start_waiting();
+    bool usable(size_t slot) const;
+    void reconnect(size_t slot);
+
+    void answered(size_t slot, Clock::time_point sent_at, const std::string &response)
+    {
+      outstanding--;
+      if (measured(sent_at)) {
+        completed++;
+        latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - sent_at).count());
+        statuses[status_of(response)]++;
+      }
+      if (rate == 0 && sending)
+        issue(slot, Clock::now());
+      start_waiting();
+      finish_if_done();
+    }
+
+    void failed(size_t slot, Clock::time_point sent_at)
+    {
+      outstanding--;
+      if (measured(sent_at))
+        errors++;
+      if (rate == 0 && sending && usable(slot))
+        issue(slot, Clock::now());
+      start_waiting();
+      finish_if_done();
+    }
+
+    void finish_if_done()
+    {
+      if (!sending && outstanding == 0)
+        io_service.stop();
+    }
+
+    static std::string status_of(const std::string &response)
+    {
+      static const std::string prefix = "{\"status\":\"";
+      if (response.compare(0, prefix.size(), prefix) != 0)
+        return "unknown";
+      size_t end = response.find('"', prefix.size());
+      return end == std::string::npos ? "unknown" : response.substr(prefix.size(), end - prefix.size());
+    }
+
+    // Sends the requests that are due, at the rate, then waits for the next.
+    void send_due()
+    {
+      Clock::time_point now = Clock::now();
+      while (sending) {
+        Clock::time_point due = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(issued / rate));
+        if (due >= measure_until) {
+          stop_sending();
+          break;
+        }
+        if (due > now) {
+          timer.expires_at(due);
+          timer.async_wait([this](const boost::system::error_code &error) {
+            if (!error)
+              send_due();
+          });
+          return;
+        }
+        issue(issued % settings.connections, due);
+      }
+    }
+
+    void stop_sending()
+    {
+      sending = false;
+      drain_timer.expires_at(measure_until + settings.drain);
+      drain_timer.async_wait([this](const boost::system::error_code &error) {
+        if (!error)
+          io_service.stop();
+      });
+      finish_if_done();
+    }
+
+  public:
+    Stage(const Settings &settings, const std::vector<std::string> &corpus, double rate) :
+        settings(settings),
+        corpus(corpus),
+        rate(rate)
+    {
+    }
+
+    // Returns false if the server could not be connected to.
+    bool run(); // defined after the connections
+
+    double seconds() const { return std::chrono::duration<double>(measure_until - measure_from).count(); }
+
+    void write_text(std::ostream &out) const
+    {
+      eval::Histogram::Sum latency_sum;
+      latency_sum.add(latency);
+      out << (rate == 0 ? "closed loop" : "open loop at " + std::to_string(uint64_t(rate)) + "/s") << ", "
+          << settings.connections << (settings.framed ? " connections" : " concurrent requests") << ": "
+          << completed << " requests in " << seconds() << " s, " << completed / seconds() << "/s\n ";
+      for (const auto &status : statuses)
+        out << " " << status.first << ": " << status.second << ",";
+      out << " errors: " << errors << ", unanswered: " << sent - completed - errors << "\n"
+          << "  latency (ms): mean " << latency_sum.mean() / 1e6
+          << ", p50 " << latency_sum.percentile(0.5) / 1e6
+          << ", p90 " << latency_sum.percentile(0.9) / 1e6
+          << ", p99 " << latency_sum.percentile(0.99) / 1e6
+          << ", p99.9 " << latency_sum.percentile(0.999) / 1e6
+          << ", max " << latency_sum.percentile(1) / 1e6 << "\n";
+    }
+
+    void write_json(std::ostream &out) const
+    {
+      eval::Histogram::Sum latency_sum;
+      latency_sum.add(latency);
+      out << "{\"mode\":\"" << (rate == 0 ? "closed" : "open") << "\",\"rate\":" << rate
+          << ",\"connections\":" << settings.connections
+          << ",\"duration\":" << seconds()
+          << ",\"sent\":" << sent
+          << ",\"completed\":" << completed
+          << ",\"throughput\":" << completed / seconds()
+          << ",\"statuses\":{";
+      std::string status_counts;
+      eval::JsonWriter json(status_counts);
+      for (const auto &status : statuses) {
+        json.raw(json.size() == 0 ? "" : ",");
+        json.string(status.first);
+        json.raw(':');
+        json.integer(status.second);
+      }
+      out << status_counts;
+      out << "},\"errors\":" << errors
+          << ",\"unanswered\":" << sent - completed - errors
+          << ",\"latency\":";
+      latency_sum.write_json(out);
+      out << "}";
+    }
+};
+
+// A long-lived connection in the framed protocol. Requests are pipelined:
+// written as they come, whether or not earlier ones were answered.
+class FramedConnection : public std::enable_shared_from_this<FramedConnection> {
+  private:
+    Stage &stage;
+    const size_t slot;
+    tcp::socket sock;
+    bool broken_ = false;
+    std::deque<Clock::time_point> in_flight; // when each unanswered request was sent
+    std::string queued; // frames not written yet
+    std::string writing;
+    uint32_t frame_length;
+    std::string response;
+
+    // Replaces this connection in its slot, then fails what was in flight.
+    void fail()
+    {
+      if (broken_)
+        return;
+      broken_ = true;
+      boost::system::error_code ignored;
+      sock.close(ignored);
+      stage.reconnect(slot);
+      std::deque<Clock::time_point> failed;
+      failed.swap(in_flight);
+      for (Clock::time_point sent_at : failed)
+        stage.failed(slot, sent_at);
+    }
+
+    void flush()
+    {
+      if (broken_ || !writing.empty() || queued.empty())
+        return;
+      writing.swap(queued);
+      auto self = shared_from_this();
+      boost::asio::async_write(sock, boost::asio::buffer(writing), [self](const boost::system::error_code &error, size_t) {
+        self->writing.clear();
+        if (error)
+          return self->fail();
+        self->flush();
+      });
+    }
+
+    void read_frame()
+    {
+      auto self = shared_from_this();
+      boost::asio::async_read(sock, boost::asio::buffer(&frame_length, sizeof(frame_length)), [self](const boost::system::error_code &error, size_t) {
+        if (error)
+          return self->fail();
+        self->response.resize(ntohl(self->frame_length));
+        boost::asio::async_read(self->sock, boost::asio::buffer(&self->response[0], self->response.size()), [self](const boost::system::error_code &error, size_t) {
+          if (error || self->in_flight.empty())
+            return self->fail();
+          Clock::time_point sent_at = self->in_flight.front();
+          self->in_flight.pop_front();
+          self->stage.answered(self->slot, sent_at, self->response);
+          self->read_frame();
+        });
+      });
+    }
+
+  public:
+    FramedConnection(Stage &stage, size_t slot) :
+        stage(stage),
+        slot(slot),
+        sock(stage.io_service)
+    {
+    }
+
+    bool connect()
+    {
+      boost::system::error_code error;
+      sock.connect(stage.settings.endpoint, error);
+      if (error)
+        return false;
+      sock.set_option(tcp::no_delay(true));
+      queued.push_back('\0');
+      return true;
+    }
+
+    void start()
+    {
+      flush();
+      read_frame();
+    }
+
+    bool broken() const { return broken_; }
+
+    void send(const std::string &request, Clock::time_point sent_at)
+    {
+      if (broken_)
+        return stage.failed(slot, sent_at);
+      uint32_t length = htonl(request.size());
+      queued.append(reinterpret_cast<const char *>(&length), sizeof(length));
+      queued.append(request);
+      in_flight.push_back(sent_at);
+      flush();
+    }
+};
+
+// A request on a connection of its own, in the one-shot protocol. These are
+// all in slot 0, any request can take the place of any other.
+class PlainRequest : public std::enable_shared_from_this<PlainRequest> {
+  private:
+    Stage &stage;
+    const std::string &request;
+    const Clock::time_point sent_at;
+    tcp::socket sock;
+    std::string response;
+
+  public:
+    PlainRequest(Stage &stage, const std::string &request, Clock::time_point sent_at) :
+        stage(stage),
+        request(request),
+        sent_at(sent_at),
+        sock(stage.io_service)
+    {
+    }
+
+    void start()
+    {
+      auto self = shared_from_this();
+      sock.async_connect(stage.settings.endpoint, [self](const boost::system::error_code &error) {
+        if (error)
+          return self->stage.failed(0, self->sent_at);
+        boost::asio::async_write(self->sock, boost::asio::buffer(self->request), [self](const boost::system::error_code &error, size_t) {
+          if (error)
+            return self->stage.failed(0, self->sent_at);
+          boost::system::error_code ignored;
+          self->sock.shutdown(tcp::socket::shutdown_send, ignored);
+          boost::asio::async_read(self->sock, boost::asio::dynamic_buffer(self->response), boost::asio::transfer_all(), [self](const boost::system::error_code &error, size_t) {
+            if (error != boost::asio::error::eof)
+              return self->stage.failed(0, self->sent_at);
+            self->stage.answered(0, self->sent_at, self->response);
+          });
+        });
+      });
+    }
+};
+
+void Stage::issue(size_t slot, Clock::time_point sent_at)
+{
+  const std::string &request = corpus[issued++ % corpus.size()];
+  if (measured(sent_at))
+    sent++;
+  if (settings.framed) {
+    outstanding++;
+    connections[slot]->send(request, sent_at);
+    return;
+  }
+  waiting.push_back(Waiting{&request, sent_at});
+  start_waiting();
+}
+
+void Stage::start_waiting()
+{
+  while (!waiting.empty() && outstanding < settings.connections) {
+    outstanding++;
+    std::make_shared<PlainRequest>(*this, *waiting.front().request, waiting.front().sent_at)->start();
+    waiting.pop_front();
+  }
+}
+
+bool Stage::usable(size_t slot) const
+{
+  return !settings.framed || !connections[slot]->broken();
+}
+
+// Leaves the broken connection in its slot if the server cannot be
+// connected to anymore.
+void Stage::reconnect(size_t slot)
+{
+  if (!sending)
+    return;
+  auto connection = std::make_shared<FramedConnection>(*this, slot);
+  if (!connection->connect())
+    return;
+  connections[slot] = connection;
+  connection->start();
+}
+
+bool Stage::run()
+{
+  if (settings.framed) {
+    for (size_t i = 0; i < settings.connections; i++) {
+      connections.push_back(std::make_shared<FramedConnection>(*this, i));
+      if (!connections.back()->connect())
+        return false;
+    }
+    for (auto &connection : connections)
+      connection->start();
+  }
+
+  start = Clock::now();
+  measure_from = start + settings.warmup;
+  measure_until = measure_from + settings.duration;
+  if (rate == 0) {
+    for (size_t i = 0; i < settings.connections; i++)
+      issue(i, start);
+    timer.expires_at(measure_until);
+    timer.async_wait([this](const boost::system::error_code &error) {
+      if (!error)
+        stop_sending();
+    });
+  } else {
+    send_due();
+  }
+  io_service.run();
+  return true;
+}
+
+int main(int argc, char* argv[])
+{
+  std::string host;
+  int port;
+  std::vector<std::string> corpus_files;
+  std::string code;
+  std::string protocol;
+  Settings settings;
+  std::vector<double> rates;
+  double warmup_s, duration_s, drain_s;
+  bool json;
+  po::options_description desc("Allowed options");
+  desc.add_options()
+      ("help", "produce help message")
+      ("host", po::value<std::string>(&host)->default_value("127.0.0.1"), "server to send requests to")
+      ("port", po::value<int>(&port)->default_value(1101), "port the server listens on")
+      ("corpus", po::value<std::vector<std::string>>(&corpus_files), "requests to send, in turn: a .jsonl file with one request per line, or a file with one request (repeatable)")
+      ("code", po::value<std::string>(&code)->default_value("return data.length"), "code to run on corpus files that are data, not a request")
+      ("protocol", po::value<std::string>(&protocol)->default_value("framed"), "framed (long-lived connections) or plain (a connection per request)")
+      ("connections", po::value<size_t>(&settings.connections)->default_value(16), "number of connections (or concurrent plain requests)")
+      ("rate", po::value<std::vector<double>>(&rates), "requests per second, for an open-loop stage, 0 for a closed-loop one (repeatable, one stage each; defaults to closed-loop)")
+      ("warmup", po::value<double>(&warmup_s)->default_value(2), "seconds of each stage not measured")
+      ("duration", po::value<double>(&duration_s)->default_value(10), "seconds of each stage measured")
+      ("drain", po::value<double>(&drain_s)->default_value(5), "seconds to wait for responses after each stage")
+      ("json", po::bool_switch(&json), "report as JSON")
+  ;
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, desc), vm);
+  po::notify(vm);
+  if (vm.count("help") || corpus_files.empty()) {
+      std::cout << desc << "\n";
+      return 1;
+  }
+
+  std::vector<std::string> corpus;
+  for (const std::string &file : corpus_files) {
+    if (!load_corpus(file, code, corpus)) {
+      std::cerr << "Cannot read corpus " << file << "\n";
+      return 1;
+    }
+  }
+  if (corpus.empty()) {
+    std::cerr << "Corpus is empty\n";
+    return 1;
+  }
+  if (protocol != "framed" && protocol != "plain") {
+    std::cerr << "--protocol must be framed or plain\n";
+    return 1;
+  }
+  if (settings.connections == 0) {
+    std::cerr << "--connections must be positive\n";
+    return 1;
+  }
+  if (rates.empty())
+    rates.push_back(0);
+
+  boost::asio::io_service io_service;
+  tcp::resolver resolver(io_service);
+  boost::system::error_code error;
+  auto endpoints = resolver.resolve(host, std::to_string(port), error);
+  if (error || endpoints.empty()) {
+    std::cerr << "Cannot resolve " << host << "\n";
+    return 1;
+  }
+  settings.endpoint = *endpoints.begin();
+  settings.framed = protocol == "framed";
+  auto seconds = [](double s) { return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(s)); };
+  settings.warmup = seconds(warmup_s);
+  settings.duration = seconds(duration_s);
+  settings.drain = seconds(drain_s);
+
+  if (json)
+    std::cout << "{\"corpus\":" << corpus.size() << ",\"stages\":[";
+  for (size_t i = 0; i < rates.size(); i++) {
+    Stage stage(settings, corpus, rates[i]);
+    if (!stage.run()) {
+      std::cerr << "Cannot connect to " << settings.endpoint << "\n";
+      return 1;
+    }
+    if (json) {
+      std::cout << (i ? "," : "");
+      stage.write_json(std::cout);
+    } else {
+      stage.write_text(std::cout);
+    }
+    std::cout.flush();
+  }
+  if (json)
+    std::cout << "]}\n";
+  return 0;
+}